@@ -2,31 +2,103 @@
 #define CACHE_H
 
 #include "nlohmann/json.hpp"
+#include "ssplus-cache-me/cache_config.h"
+#include "ssplus-cache-me/codec.h"
+#include "ssplus-cache-me/key_filter.h"
+#include "ssplus-cache-me/key_index.h"
+#include "ssplus-cache-me/persistent_map.h"
+#include "ssplus-cache-me/tag_index.h"
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace ssplus_cache_me::cache {
 
+class entry_t;
+
+// immutable, reference counted value buffer. Copying only bumps the
+// reference count, so a handle is cheap to hand out from under the shard
+// lock and stays valid after the lock is released.
+// The buffer is allocated from the slab allocator, a value stored in the
+// cache shares the packed block of its entry
+class value_t {
+public:
+  struct block_t;
+
+private:
+  block_t *buf;
+
+  void release() noexcept;
+
+  friend class entry_t;
+
+public:
+  value_t() noexcept : buf(nullptr) {}
+  explicit value_t(std::string &&s);
+  value_t(const char *data, size_t len);
+
+  value_t(const value_t &o) noexcept;
+  value_t(value_t &&o) noexcept;
+  value_t &operator=(const value_t &o) noexcept;
+  value_t &operator=(value_t &&o) noexcept;
+  ~value_t();
+
+  const char *data() const noexcept;
+  size_t size() const noexcept;
+  bool empty() const noexcept;
+
+  std::string_view view() const noexcept;
+  std::string str() const;
+
+  // whether both handles point to the same buffer
+  bool shares(const value_t &o) const noexcept;
+
+  // estimated heap bytes owned by the buffer
+  size_t memory_usage() const noexcept;
+};
+
 struct data_t {
-  std::string value;
+  // stored bytes, compressed when codec isn't identity
+  value_t value;
 
-  // unix timestamp in ms.
-  // ts of 1 is magic value to mark key is known to not exist in db
+  // unix timestamp in ms, 0 when it never expires
   uint64_t expires_at;
 
+  codec::codec_t codec;
+
+  // bumped by every set, see next_version(). 0 for rows from before
+  // entries had one
+  uint64_t version;
+
+  // ms the value takes to recompute, the hint of refresh_early(). 0 when
+  // it's not given
+  uint16_t delta;
+
   data_t();
 
   bool empty() const;
   bool expired() const;
   data_t &clear();
 
-  data_t &mark_cached();
-  bool cached() const;
-
   uint64_t get_expires_at() const noexcept;
 
+  bool compressed() const noexcept;
+
+  // the value as it was set, decompressed when needed. Empty when the
+  // stored value is corrupt
+  value_t plain() const;
+
+  // compress value when it's at least compress_min_size bytes and it
+  // actually shrinks
+  data_t &compress();
+
   // build struct from json string.
   // any validation error will leave the struct unmodified
   int from_json_str(const std::string &s) noexcept;
@@ -36,33 +108,261 @@ struct data_t {
   // may throw nlohmann error (although highly unlikely)
   int from_json(const nlohmann::json &d);
 
+  // these always hold the plain value
   nlohmann::json to_json() const;
   std::string to_json_str(int indent = -1) const;
+
+  // append the same output as to_json_str() to out, escaping the value
+  // straight from its buffer without building a json object
+  void dump_json(std::string &out) const;
 };
 
-using cache_map_t = std::unordered_map<std::string, data_t>;
-using set_return_t = std::pair<cache_map_t::iterator, bool>;
-using vector_data_t = std::vector<data_t>;
-using get_all_return_t = std::pair<vector_data_t, bool>;
+// the stored data and whether the key was new. The data isn't cached()
+// when the entry got evicted right away
+using set_return_t = std::pair<data_t, bool>;
+// every row in db, keyed by key. Copies are O(1) and never change, see
+// persistent_map.h
+using all_data_t = persistent_map::persistent_map_t<std::string, data_t>;
+// the rows and whether they've been loaded from db yet
+using get_all_return_t = std::pair<all_data_t, bool>;
+
+// upper bound of shard count, anything above will be clamped to this
+inline constexpr size_t max_shard_count = 4096;
+
+// split the memory cache into shards, each with its own lock and map.
+// shard_count will be rounded up to the next power of two.
+// must be called once before any other cache function.
+// also starts the thread expiring entries past their expires_at
+int init(const cache_config_t &conf) noexcept;
+
+// stop the expiry thread
+void shutdown() noexcept;
+
+size_t get_shard_count() noexcept;
+
+// estimated bytes used by all shards, tables included
+size_t memory_usage() noexcept;
+
+struct memory_stats_t {
+  // memory cache entries and the key and value bytes packed in them
+  size_t entries = 0;
+  size_t key_bytes = 0;
+  size_t value_bytes = 0;
+  // shard tables, entry headers and slab rounding on top of those
+  size_t overhead = 0;
+  // misses waiting on a db load
+  size_t loads = 0;
+  // acquire_lease() leases, expired ones until they're swept
+  size_t leases = 0;
 
-std::lock_guard<std::shared_mutex> acquire_lock();
-std::shared_lock<std::shared_mutex> acquire_shared_lock();
+  // get_all() rows, counted once loaded
+  bool view_loaded = false;
+  size_t view_rows = 0;
+  size_t view_bytes = 0;
 
-data_t get_unlocked(const std::string &key);
-data_t get(const std::string &key);
+  // known_absent() filter, what the cache keeps instead of negative entries
+  size_t filter_keys = 0;
+  size_t filter_bytes = 0;
 
-get_all_return_t get_all_unlocked();
+  // list_keys() index
+  size_t index_keys = 0;
+  size_t index_bytes = 0;
+
+  // tagged_keys() index
+  size_t tags = 0;
+  size_t tagged = 0;
+  size_t tags_bytes = 0;
+};
+
+// read from counters every write keeps up to date, costs a shared lock per
+// shard and no walk over entries
+memory_stats_t get_memory_stats();
+
+// lock the shard owning key
+std::lock_guard<std::shared_mutex> acquire_lock(std::string_view key);
+std::shared_lock<std::shared_mutex> acquire_shared_lock(std::string_view key);
+
+// an entry past its expires_at is returned empty, like a miss.
+// get() doesn't take the shard lock unless it keeps racing writers, reads
+// are protected by epoch reclamation instead, see epoch.h
+data_t get_unlocked(std::string_view key);
+data_t get(std::string_view key);
+
+// a copy of every row in db as of the last query the db writer ran. Once
+// loaded it's patched by mark_persisted() and mark_deleted() as the writer
+// runs set and delete queries, so it never needs a reload.
+// Rows can be past their expires_at until their delete query runs
 get_all_return_t get_all();
 
-set_return_t set_unlocked(const std::string &key, const data_t &value);
-set_return_t set(const std::string &key, const data_t &value);
+// get_all(), waiting up to timeout for the first load
+get_all_return_t wait_all(std::chrono::milliseconds timeout);
+
+// a version newer than any handed out before, also across restarts. Starts
+// from the clock on init(), so it stays within 2^53 for json clients
+uint64_t next_version() noexcept;
+
+// versions from now on are newer than version, for the highest one in db
+void observe_version(uint64_t version) noexcept;
+
+// from_db marks value as already matching the db, only entries matching the
+// db can be evicted when the cache is over max_memory. Anything else gets
+// the next_version(), the data returned carries it
+set_return_t set_unlocked(const std::string &key, const data_t &value,
+                          bool from_db = false);
+set_return_t set(const std::string &key, const data_t &value,
+                 bool from_db = false);
+
+// conditions of set_if() on what key currently has
+struct set_condition_t {
+  // only when it has no value
+  bool nx = false;
+  // only when it has one
+  bool xx = false;
+  // only when it has this version
+  std::optional<uint64_t> if_version;
+  // only with this live lease on key, see acquire_lease()
+  std::optional<uint64_t> lease;
+
+  bool holds(const data_t &current) const noexcept;
+};
+
+// what set_if() did
+enum set_if_result_t { set_done, set_unmet, set_no_lease };
+
+// set() when cond holds, checked and set under the shard lock. A key missing
+// from memory is read from db with load first, like get_or_load(). current
+// is what key had, empty when it had nothing
+set_if_result_t set_if(const std::string &key, const data_t &value,
+                       const set_condition_t &cond,
+                       const std::function<data_t()> &load,
+                       set_return_t &ret, data_t &current);
+
+// right to set a missing key, so only one of the callers missing it
+// recomputes the value
+struct lease_t {
+  uint64_t token = 0;
+  uint64_t expires_at = 0;
+};
+
+// what acquire_lease() did
+enum lease_result_t { lease_granted, lease_taken, lease_cached };
+
+// a lease on key for ttl ms to the first caller missing it, the ones after
+// get the lease it holds to wait for it. lease_cached when key got a value
+// since the caller missed it. Any set without the lease or delete of key
+// revokes it, a set_if() with it uses it up
+lease_result_t acquire_lease(const std::string &key, uint64_t ttl,
+                             lease_t &lease);
+
+// XFetch: whether the caller should recompute data, read from key, ahead of
+// its expiry, with a chance rising as expiry nears, and faster the larger
+// its delta and beta are. Only one caller is ever told per version of key,
+// whichever copy of it they read and even when it got loaded from db
+// again. No one is when memory holds a newer version
+bool refresh_early(std::string_view key, const data_t &data, double beta);
+
+// what incr() did
+enum incr_result_t { incr_done, incr_not_integer, incr_overflow };
+
+// add delta to the decimal integer value of key, a missing key counts as 0.
+// expires_at 0 keeps the expiry key had. The value is left alone when it
+// isn't an integer or the sum overflows int64_t
+incr_result_t incr(const std::string &key, int64_t delta, uint64_t expires_at,
+                   const std::function<data_t()> &load, set_return_t &ret);
+
+// key's data when memory holds a newer one than db, for writing it back
+bool get_unpersisted(std::string_view key, data_t &out);
+
+// per shard count of keys deleted from db so far, taken before reading the
+// rows given to warm()
+std::vector<uint64_t> delete_marks();
+
+// rows read from db to warm up the cache, keys cached meanwhile are newer
+// and kept. Rows of shards that saw a delete since marks were taken are
+// skipped, the row may be gone. Every shard lock is taken once per batch.
+// Returns how many rows got cached
+size_t warm(std::vector<std::pair<std::string, data_t>> &rows,
+            const std::vector<uint64_t> &marks);
+
+// called once data has been written to db, makes the entry evictable
+// if it still holds the same data. inserted is whether the row is new
+void mark_persisted(const std::string &key, const data_t &data,
+                    bool inserted);
+
+// called once the row of key has been deleted from db, its tags too
+void mark_deleted(const std::string &key);
+
+size_t key_hash(std::string_view key) noexcept;
+
+// whether key is definitely not in db, so a miss doesn't need to ask it.
+// Keys in db are tracked in a key_filter_t loaded by the db writer and kept
+// up to date by mark_persisted() and mark_deleted(), until it's loaded
+// every key may be in db
+bool known_absent(std::string_view key);
+
+// replace the filter of keys in db, only the db writer is allowed to call
+// this so it's ordered with the queries updating it
+void set_key_filter(std::unique_ptr<key_filter_t> &&filter);
+
+// the filter holds more keys than it was sized for and should be rebuilt
+bool key_filter_full() noexcept;
+
+// keys in db starting with prefix and sorting after after, in order, up to
+// limit of them. As of the last query the db writer ran like get_all(),
+// kept in an ordered index loaded by the db writer and patched by
+// mark_persisted() and mark_deleted(). Empty until it's loaded
+std::vector<std::string> list_keys(std::string_view prefix,
+                                   std::string_view after, size_t limit);
+
+// replace the index of list_keys(), only the db writer is allowed to call
+// this so it's ordered with the queries updating it
+void set_key_index(std::unique_ptr<key_index_t> &&index);
+
+// keys in db tagged with tag, as of the last query the db writer ran. Tags
+// are kept in an index loaded by the db writer and patched by mark_tagged()
+// and mark_deleted(). Empty until it's loaded
+std::vector<std::string> tagged_keys(const std::string &tag);
+
+// whether key has tags in db, see tagged_keys()
+bool has_tags(const std::string &key);
+
+// called once the tags of key have been replaced with tags in db
+void mark_tagged(const std::string &key, const std::vector<std::string> &tags);
+
+// replace the index of tagged_keys(), only the db writer is allowed to call
+// this so it's ordered with the queries updating it
+void set_tag_index(std::unique_ptr<tag_index_t> &&index);
+
+// the first load of get_all(), only the db writer is allowed to call this
+// so it's ordered with the queries patching it
+void set_all(all_data_t &&all);
+
+size_t del_unlocked(std::string_view key);
+size_t del(std::string_view key);
+
+// drop every entry with a key starting with prefix from memory, walking
+// every shard. Returns how many got dropped
+size_t del_prefix(std::string_view prefix);
+
+// del(), unless the entry is dirty. For the db writer dropping what it
+// deleted from db while keeping values set again since
+size_t del_persisted(std::string_view key);
+
+// the miss of get_or_load(), key wasn't in memory
+data_t load_missed(std::string_view key, const std::function<data_t()> &load);
 
-get_all_return_t set_all_unlocked(const vector_data_t &values,
-                                  bool loaded_state);
-get_all_return_t set_all(const vector_data_t &values, bool loaded_state);
+// get(), calling load on a miss to read key from db and caching what it
+// returns unless the key got set meanwhile. Concurrent misses on the same
+// key wait for the first one's load instead of each running their own.
+// Keys known_absent() are never loaded. A template so a hit doesn't wrap
+// load in a std::function
+template <typename F> data_t get_or_load(std::string_view key, F &&load) {
+  data_t ret = get(key);
+  if (!ret.empty() || known_absent(key))
+    return ret;
 
-size_t del_unlocked(const std::string &key);
-size_t del(const std::string &key);
+  return load_missed(key, load);
+}
 
 } // namespace ssplus_cache_me::cache
 
@@ -0,0 +1,30 @@
+#ifndef CACHE_CONFIG_H
+#define CACHE_CONFIG_H
+
+#include <cstddef>
+
+namespace ssplus_cache_me::cache {
+
+struct cache_config_t {
+  // number of memory cache shards, rounded up to power of two.
+  // 0 means derive from concurrency
+  size_t shard_count;
+
+  // upper bound of memory cache size in bytes, 0 means unbounded
+  size_t max_memory;
+
+  // back the slab allocator with 2MB huge pages
+  bool huge_pages;
+
+  // values of at least this many bytes are stored gzip compressed in
+  // memory and in db, 0 disables compression
+  size_t compress_min_size;
+
+  cache_config_t()
+      : shard_count(0), max_memory(0), huge_pages(false),
+        compress_min_size(0) {}
+};
+
+} // namespace ssplus_cache_me::cache
+
+#endif // CACHE_CONFIG_H
@@ -0,0 +1,76 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Value compression.
+ *
+ * Compressed values are stored as a complete gzip member, so they can be
+ * sent as is to a client accepting Content-Encoding: gzip.
+ *
+ * Work is counted per endpoint: a handler names its stats_t for the scope
+ * of a request, anything done outside of one is counted under "other".
+ */
+namespace ssplus_cache_me::codec {
+
+// how a stored value is encoded, persisted in the "codec" db column
+enum codec_t : uint8_t { identity = 0, gzip = 1 };
+
+struct stats_t {
+  const char *endpoint;
+
+  std::atomic<uint64_t> compressed = 0;
+  std::atomic<uint64_t> compressed_in = 0;
+  std::atomic<uint64_t> compressed_out = 0;
+  std::atomic<uint64_t> compress_ns = 0;
+
+  std::atomic<uint64_t> decompressed = 0;
+  std::atomic<uint64_t> decompressed_in = 0;
+  std::atomic<uint64_t> decompressed_out = 0;
+  std::atomic<uint64_t> decompress_ns = 0;
+
+  // compressed values sent as is to clients accepting gzip
+  std::atomic<uint64_t> passthrough = 0;
+
+  // registers itself for get_stats(), must never be destroyed
+  explicit stats_t(const char *_endpoint);
+
+  stats_t(const stats_t &) = delete;
+  stats_t &operator=(const stats_t &) = delete;
+};
+
+// every stats_t created, "other" first
+std::vector<const stats_t *> get_stats();
+
+// counts the calling thread's work into st while in scope. Nests
+class scope_t {
+  stats_t *prev;
+
+public:
+  explicit scope_t(stats_t &st) noexcept;
+  ~scope_t();
+
+  scope_t(const scope_t &) = delete;
+  scope_t &operator=(const scope_t &) = delete;
+};
+
+// s as a gzip member, empty on failure
+std::string gzip_compress(std::string_view s);
+
+// false when s isn't a valid gzip member
+bool gzip_decompress(std::string_view s, std::string &out);
+
+// a compressed value got sent without decompressing it
+void count_passthrough() noexcept;
+
+// whether an Accept-Encoding header value allows gzip
+bool accepts_gzip(std::string_view accept_encoding) noexcept;
+
+} // namespace ssplus_cache_me::codec
+
+#endif // CODEC_H
@@ -4,6 +4,8 @@
 #include "ssplus-cache-me/cache.h"
 #include <sqlite3.h>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace ssplus_cache_me::db {
 
@@ -16,21 +18,67 @@ int close(sqlite3 **conn) noexcept;
 int prepare_statement(sqlite3 *conn, const char *query, sqlite3_stmt **stmt,
                       const std::string &stmt_key = std::string()) noexcept;
 
+// statements in the cache prepare_statement() keeps, and the memory
+// sqlite reports for them
+void get_stmt_cache_stats(size_t &count, size_t &bytes) noexcept;
+
 void reset_statement(sqlite3_stmt **stmt) noexcept;
 
 int finalize_statement(const std::string &stmt_key,
                        sqlite3_stmt **stmt) noexcept;
 
 // only servers are allowed to call this
-cache::data_t get_cache(sqlite3 *conn, const std::string &key,
+cache::data_t get_cache(sqlite3 *conn, std::string_view key,
                         int server_id) noexcept;
 
-// only servers are allowed to call this
-cache::vector_data_t get_all_cache(sqlite3 *conn, int server_id) noexcept;
+// scan every row straight from db, only servers are allowed to call this
+cache::all_data_t get_all_cache(sqlite3 *conn, int server_id) noexcept;
+
+// queue the first load of cache::get_all() on the db writer
+int load_all_cache() noexcept;
+
+// queue a scan of every key in db to rebuild cache::known_absent()'s
+// filter, on boot and whenever it outgrew its size
+int load_key_filter() noexcept;
+
+// queue warming up the memory cache with every row not expired, on boot
+// once the cleanup ran. Rows are scanned in rowid ranges by threads on
+// their own read conn of path while servers already take traffic. threads
+// 0 skips it and the cache is warm() right away
+int warm_up(const std::string &path, int threads) noexcept;
+
+// warm up finished, stopped early or skipped
+bool warm() noexcept;
 
-int set_cache(const std::string &key, const cache::data_t &data) noexcept;
+// rows cached by the warm up so far
+size_t warmed_rows() noexcept;
+
+// tags replace the ones key had
+int set_cache(const std::string &key, const cache::data_t &data,
+              const std::vector<std::string> &tags = {}) noexcept;
 int delete_cache(const std::string &key, uint64_t at = 0) noexcept;
 
+// queue writing the value memory holds for key back in delay_ms, unless
+// it's queued already. Every cache::incr() meanwhile lands in that one
+// write
+int flush_counter(const std::string &key, uint64_t delay_ms) noexcept;
+
+// delete every row with a key starting with prefix in a single range
+// delete. Memory entries are left to the caller, see cache::del_prefix()
+int delete_prefix(const std::string &prefix) noexcept;
+
+// delete every row tagged with tag in a single delete. Memory entries are
+// left to the caller, see cache::tagged_keys(), except the ones that got
+// persisted while this was queued
+int delete_tag(const std::string &tag) noexcept;
+
+// queue loading the tag index of cache::tagged_keys() on boot
+int load_tags() noexcept;
+
+// queue making cache::next_version() newer than every version in db, on
+// boot
+int load_max_version() noexcept;
+
 int cleanup() noexcept;
 
 } // namespace ssplus_cache_me::db
@@ -0,0 +1,56 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <cstddef>
+
+/**
+ * Quiescent state based reclamation for memory read without locks.
+ *
+ * A thread is online while it may hold pointers read from a structure that
+ * writers change concurrently. Memory a writer unlinked is retired instead
+ * of freed, and only freed once every thread that was online at the time
+ * has gone offline or reported a quiescent state.
+ *
+ * Threads running an event loop register themselves and report a
+ * quiescent state once per loop iteration: they go online on their first
+ * read of an iteration and stay online until quiescent(), so a burst of
+ * reads costs a single fence. Every other thread is only online for the
+ * scope of a read_guard_t.
+ */
+namespace ssplus_cache_me::epoch {
+
+using free_fn_t = void (*)(void *p, size_t n);
+
+// the calling thread reports its own quiescent states through quiescent()
+void register_thread() noexcept;
+void unregister_thread() noexcept;
+
+// the calling thread no longer holds anything it read under a guard. Also
+// frees what it retired that's safe by now.
+// must not be called inside a read_guard_t
+void quiescent() noexcept;
+
+// reads through pointers that writers may retire must happen inside one.
+// Nests
+class read_guard_t {
+public:
+  read_guard_t();
+  ~read_guard_t();
+
+  read_guard_t(const read_guard_t &) = delete;
+  read_guard_t &operator=(const read_guard_t &) = delete;
+};
+
+// fn(p, n) once no reader can still see p. p must already be unreachable
+// for new readers
+void retire(void *p, size_t n, free_fn_t fn) noexcept;
+
+// retired and not yet freed, by all threads
+size_t get_pending_count() noexcept;
+
+// sum of n of those
+size_t get_pending_bytes() noexcept;
+
+} // namespace ssplus_cache_me::epoch
+
+#endif // EPOCH_H
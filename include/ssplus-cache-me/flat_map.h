@@ -0,0 +1,698 @@
+#ifndef FLAT_MAP_H
+#define FLAT_MAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Open addressing hash set/map in the spirit of abseil's swiss table.
+ *
+ * Every slot has a control byte stored in a separate array: the top bit marks
+ * empty/deleted, the remaining 7 bits of a full slot are the low 7 bits of the
+ * key hash (h2). Lookup loads a whole group of control bytes at once and
+ * compares h2 against all of them with SIMD (AVX2: 32, SSE2: 16, portable: 8
+ * bytes), so most misses never touch the slot array.
+ *
+ * Capacity is always a power of two not smaller than the group width. The
+ * first group of control bytes is mirrored past the end of the array so a
+ * group can be loaded from any position without wrapping.
+ *
+ * Lookups may also run concurrently with a writer through
+ * probe_concurrent(), for readers validating the result themselves (eg.
+ * with a seqlock) and a Free policy that defers releasing replaced tables
+ * until such readers are done with them.
+ */
+namespace ssplus_cache_me::flat_map {
+
+using ctrl_t = int8_t;
+
+inline constexpr ctrl_t ctrl_empty = -128; // 0b10000000
+inline constexpr ctrl_t ctrl_deleted = -2; // 0b11111110
+
+inline bool is_full(ctrl_t c) noexcept { return c >= 0; }
+
+#if defined(__AVX2__)
+
+struct group_t {
+  static constexpr size_t width = 32;
+  using mask_t = uint32_t;
+
+  __m256i ctrl;
+
+  explicit group_t(const ctrl_t *p)
+      : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))) {}
+
+  mask_t match(ctrl_t h2) const noexcept {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl));
+  }
+
+  mask_t match_empty() const noexcept { return match(ctrl_empty); }
+
+  // empty and deleted are the only negative values
+  mask_t match_empty_or_deleted() const noexcept {
+    return _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_setzero_si256(), ctrl));
+  }
+
+  static size_t lowest(mask_t m) noexcept { return __builtin_ctz(m); }
+  static size_t leading(mask_t m) noexcept { return __builtin_clz(m); }
+};
+
+#elif defined(__SSE2__)
+
+struct group_t {
+  static constexpr size_t width = 16;
+  using mask_t = uint32_t;
+
+  __m128i ctrl;
+
+  explicit group_t(const ctrl_t *p)
+      : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+
+  mask_t match(ctrl_t h2) const noexcept {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+  }
+
+  mask_t match_empty() const noexcept { return match(ctrl_empty); }
+
+  // empty and deleted are the only negative values
+  mask_t match_empty_or_deleted() const noexcept {
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_setzero_si128(), ctrl));
+  }
+
+  static size_t lowest(mask_t m) noexcept { return __builtin_ctz(m); }
+  static size_t leading(mask_t m) noexcept {
+    return __builtin_clz(m) - (32 - width);
+  }
+};
+
+#else
+
+// portable SWAR fallback, one bit at the msb of each matching byte.
+// assumes little endian
+struct group_t {
+  static constexpr size_t width = 8;
+  using mask_t = uint64_t;
+
+  static constexpr uint64_t lsbs = 0x0101010101010101ull;
+  static constexpr uint64_t msbs = 0x8080808080808080ull;
+
+  uint64_t ctrl;
+
+  explicit group_t(const ctrl_t *p) { std::memcpy(&ctrl, p, sizeof(ctrl)); }
+
+  // may report false positives, callers always compare the key anyway
+  mask_t match(ctrl_t h2) const noexcept {
+    uint64_t x = ctrl ^ (lsbs * static_cast<uint8_t>(h2));
+    return (x - lsbs) & ~x & msbs;
+  }
+
+  mask_t match_empty() const noexcept { return ctrl & ~(ctrl << 6) & msbs; }
+
+  mask_t match_empty_or_deleted() const noexcept {
+    return ctrl & ~(ctrl << 7) & msbs;
+  }
+
+  static size_t lowest(mask_t m) noexcept { return __builtin_ctzll(m) >> 3; }
+  static size_t leading(mask_t m) noexcept { return __builtin_clzll(m) >> 3; }
+};
+
+#endif
+
+// releases table memory of n bytes
+struct free_t {
+  void operator()(void *p, size_t) const noexcept { std::free(p); }
+};
+
+// stores T directly in the slot array, KeyOf{}(const T &) gives the part
+// Hash and KeyEqual work on
+template <typename T, typename KeyOf, typename Hash, typename KeyEqual,
+          typename Free = free_t>
+class flat_set_t {
+  using slot_t = T;
+
+  static constexpr size_t width = group_t::width;
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  // the capacity is stored in front of the control bytes, so concurrent
+  // readers get a consistent view of a table from a single pointer
+  static constexpr size_t ctrl_offset =
+      alignof(slot_t) > sizeof(size_t) ? alignof(slot_t) : sizeof(size_t);
+
+  ctrl_t *ctrl;
+  slot_t *slots;
+  size_t mask;
+  size_t count;
+  // number of empty slots we can still fill before having to rehash,
+  // deleted slots don't give any back
+  size_t growth_left;
+
+  // ctrl as seen by probe_concurrent(), only set once a table is complete
+  std::atomic<ctrl_t *> published;
+
+  static size_t max_load(size_t capacity) noexcept {
+    return capacity - capacity / 8;
+  }
+
+  static size_t slots_offset(size_t capacity) noexcept {
+    size_t n = capacity + width;
+    return (n + alignof(slot_t) - 1) & ~(alignof(slot_t) - 1);
+  }
+
+  static size_t alloc_size(size_t capacity) noexcept {
+    return ctrl_offset + slots_offset(capacity) + capacity * sizeof(slot_t);
+  }
+
+  static void *alloc_of(ctrl_t *c) noexcept {
+    return reinterpret_cast<char *>(c) - ctrl_offset;
+  }
+
+  static size_t capacity_of(const ctrl_t *c) noexcept {
+    size_t ret;
+    std::memcpy(&ret, reinterpret_cast<const char *>(c) - ctrl_offset,
+                sizeof(ret));
+    return ret;
+  }
+
+  static slot_t *slots_of(ctrl_t *c, size_t capacity) noexcept {
+    return reinterpret_cast<slot_t *>(reinterpret_cast<char *>(c) +
+                                      slots_offset(capacity));
+  }
+
+  void free_table(ctrl_t *c) noexcept {
+    if (c)
+      Free{}(alloc_of(c), alloc_size(capacity_of(c)));
+  }
+
+  static ctrl_t h2_of(size_t hash) noexcept {
+    return static_cast<ctrl_t>(hash & 0x7f);
+  }
+
+  static size_t h1_of(size_t hash) noexcept { return hash >> 7; }
+
+  size_t capacity_unchecked() const noexcept { return mask + 1; }
+
+  void set_ctrl(size_t i, ctrl_t c) noexcept {
+    // a concurrent reader seeing the new control byte must see the slot
+    // written before it
+    std::atomic_thread_fence(std::memory_order_release);
+
+    ctrl[i] = c;
+    if (i < width)
+      ctrl[capacity_unchecked() + i] = c;
+  }
+
+  template <typename F> void for_each_probe(size_t hash, F &&fn) const {
+    size_t pos = h1_of(hash) & mask;
+    size_t step = 0;
+
+    while (true) {
+      group_t g(ctrl + pos);
+      if (fn(g, pos))
+        return;
+
+      // triangular probing visits every group of a power of two table
+      step += width;
+      pos = (pos + step) & mask;
+    }
+  }
+
+  template <typename KK> size_t find_index(const KK &key, size_t hash) const {
+    if (!ctrl)
+      return npos;
+
+    const ctrl_t h2 = h2_of(hash);
+    size_t ret = npos;
+
+    for_each_probe(hash, [&](const group_t &g, size_t pos) -> bool {
+      for (auto m = g.match(h2); m; m &= m - 1) {
+        size_t i = (pos + group_t::lowest(m)) & mask;
+        if (KeyEqual{}(KeyOf{}(slots[i]), key)) {
+          ret = i;
+          return true;
+        }
+      }
+
+      return g.match_empty() != 0;
+    });
+
+    return ret;
+  }
+
+  size_t find_first_non_full(size_t hash) const noexcept {
+    size_t ret = 0;
+
+    for_each_probe(hash, [&](const group_t &g, size_t pos) -> bool {
+      auto m = g.match_empty_or_deleted();
+      if (!m)
+        return false;
+
+      ret = (pos + group_t::lowest(m)) & mask;
+      return true;
+    });
+
+    return ret;
+  }
+
+  // doesn't publish the new table, callers do once it's filled
+  void allocate(size_t capacity) {
+    void *mem = std::malloc(alloc_size(capacity));
+    if (!mem)
+      throw std::bad_alloc();
+
+    std::memcpy(mem, &capacity, sizeof(capacity));
+
+    ctrl = reinterpret_cast<ctrl_t *>(static_cast<char *>(mem) + ctrl_offset);
+    slots = slots_of(ctrl, capacity);
+    mask = capacity - 1;
+
+    std::memset(ctrl, ctrl_empty, capacity + width);
+    growth_left = max_load(capacity) - count;
+  }
+
+  void destroy_slots() noexcept {
+    if (!ctrl)
+      return;
+
+    for (size_t i = 0; i < capacity_unchecked(); i++) {
+      if (is_full(ctrl[i]))
+        slots[i].~slot_t();
+    }
+  }
+
+  void resize(size_t new_capacity) {
+    ctrl_t *old_ctrl = ctrl;
+    slot_t *old_slots = slots;
+    size_t old_capacity = ctrl ? capacity_unchecked() : 0;
+
+    allocate(new_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (!is_full(old_ctrl[i]))
+        continue;
+
+      size_t hash = Hash{}(KeyOf{}(old_slots[i]));
+      size_t ni = find_first_non_full(hash);
+
+      set_ctrl(ni, h2_of(hash));
+      new (&slots[ni]) slot_t(std::move(old_slots[i]));
+      old_slots[i].~slot_t();
+    }
+
+    published.store(ctrl, std::memory_order_release);
+    free_table(old_ctrl);
+  }
+
+  // reclaim tombstones without allocating: every full slot is re-placed
+  // at the first free position of its own probe sequence
+  void drop_deleted_without_resize() {
+    const size_t capacity = capacity_unchecked();
+
+    // deleted -> empty, full -> deleted (meaning "not yet placed")
+    for (size_t i = 0; i < capacity; i++)
+      ctrl[i] = is_full(ctrl[i]) ? ctrl_deleted : ctrl_empty;
+    std::memcpy(ctrl + capacity, ctrl, width);
+
+    alignas(slot_t) unsigned char tmp_buf[sizeof(slot_t)];
+    slot_t *tmp = reinterpret_cast<slot_t *>(tmp_buf);
+
+    for (size_t i = 0; i < capacity; i++) {
+      if (ctrl[i] != ctrl_deleted)
+        continue;
+
+      size_t hash = Hash{}(KeyOf{}(slots[i]));
+      size_t ni = find_first_non_full(hash);
+      size_t probe_start = h1_of(hash) & mask;
+
+      auto probe_group = [&](size_t pos) {
+        return ((pos - probe_start) & mask) / width;
+      };
+
+      // already in the right group, just mark it placed
+      if (probe_group(ni) == probe_group(i)) {
+        set_ctrl(i, h2_of(hash));
+        continue;
+      }
+
+      if (ctrl[ni] == ctrl_empty) {
+        set_ctrl(ni, h2_of(hash));
+        new (&slots[ni]) slot_t(std::move(slots[i]));
+        slots[i].~slot_t();
+        set_ctrl(i, ctrl_empty);
+        continue;
+      }
+
+      // target still holds an unplaced element, swap and redo this index
+      set_ctrl(ni, h2_of(hash));
+      new (tmp) slot_t(std::move(slots[i]));
+      slots[i].~slot_t();
+      new (&slots[i]) slot_t(std::move(slots[ni]));
+      slots[ni].~slot_t();
+      new (&slots[ni]) slot_t(std::move(*tmp));
+      tmp->~slot_t();
+      i--;
+    }
+
+    growth_left = max_load(capacity) - count;
+  }
+
+  void rehash_and_grow_if_necessary() {
+    if (!ctrl) {
+      resize(width);
+      return;
+    }
+
+    const size_t capacity = capacity_unchecked();
+
+    // mostly tombstones, clean up in place instead of doubling
+    if (count <= max_load(capacity) / 2)
+      drop_deleted_without_resize();
+    else
+      resize(capacity * 2);
+  }
+
+  void erase_index(size_t i) noexcept {
+    count--;
+    slots[i].~slot_t();
+
+    // a slot can go straight back to empty if no probe sequence could
+    // ever have seen a full group through it
+    const size_t before = (i - width) & mask;
+    auto empty_before = group_t(ctrl + before).match_empty();
+    auto empty_after = group_t(ctrl + i).match_empty();
+
+    bool was_never_full =
+        empty_before && empty_after &&
+        group_t::lowest(empty_after) + group_t::leading(empty_before) < width;
+
+    if (was_never_full) {
+      set_ctrl(i, ctrl_empty);
+      growth_left++;
+    } else {
+      set_ctrl(i, ctrl_deleted);
+    }
+  }
+
+public:
+  using value_type = T;
+
+  flat_set_t() noexcept
+      : ctrl(nullptr), slots(nullptr), mask(0), count(0), growth_left(0),
+        published(nullptr) {}
+
+  flat_set_t(const flat_set_t &) = delete;
+  flat_set_t &operator=(const flat_set_t &) = delete;
+
+  ~flat_set_t() {
+    destroy_slots();
+    free_table(ctrl);
+  }
+
+  size_t size() const noexcept { return count; }
+  bool empty() const noexcept { return count == 0; }
+  size_t capacity() const noexcept { return ctrl ? capacity_unchecked() : 0; }
+
+  // bytes owned by the table itself, not counting heap memory owned by
+  // the elements
+  size_t memory_usage() const noexcept {
+    return ctrl ? alloc_size(capacity_unchecked()) : 0;
+  }
+
+  // lookups take anything Hash and KeyEqual accept, eg. a std::string
+  // against keys using another allocator
+  template <typename KK> static size_t hash(const KK &key) noexcept {
+    return Hash{}(key);
+  }
+
+  template <typename KK> T *find(const KK &key, size_t hash) {
+    size_t i = find_index(key, hash);
+    return i == npos ? nullptr : &slots[i];
+  }
+
+  template <typename KK> const T *find(const KK &key, size_t hash) const {
+    size_t i = find_index(key, hash);
+    return i == npos ? nullptr : &slots[i];
+  }
+
+  // first element on the probe sequence of hash matching pred, for callers
+  // that only kept the hash of a key
+  template <typename Pred> T *find_if(size_t hash, Pred &&pred) {
+    if (!ctrl)
+      return nullptr;
+
+    const ctrl_t h2 = h2_of(hash);
+    T *ret = nullptr;
+
+    for_each_probe(hash, [&](const group_t &g, size_t pos) -> bool {
+      for (auto m = g.match(h2); m; m &= m - 1) {
+        size_t i = (pos + group_t::lowest(m)) & mask;
+        if (pred(static_cast<const T &>(slots[i]))) {
+          ret = &slots[i];
+          return true;
+        }
+      }
+
+      return g.match_empty() != 0;
+    });
+
+    return ret;
+  }
+
+  // lookup for a reader not holding the writer's lock. fn(const T &) is
+  // called on every candidate on the probe sequence of hash until it
+  // returns true. Elements can be moved, destroyed or replaced while fn
+  // looks at them, so fn must only read what stays readable after that
+  // and the caller has to validate whatever it found once done.
+  // Returns false when it gave up on a table that was changing too much
+  // to ever reach the end of the probe sequence
+  template <typename F> bool probe_concurrent(size_t hash, F &&fn) const {
+    ctrl_t *c = published.load(std::memory_order_acquire);
+    if (!c)
+      return true;
+
+    const size_t capacity = capacity_of(c);
+    const size_t m = capacity - 1;
+    const slot_t *s = slots_of(c, capacity);
+    const ctrl_t h2 = h2_of(hash);
+
+    size_t pos = h1_of(hash) & m;
+    size_t step = 0;
+
+    for (size_t groups = capacity / width; groups > 0; groups--) {
+      group_t g(c + pos);
+
+      for (auto mm = g.match(h2); mm; mm &= mm - 1) {
+        if (fn(s[(pos + group_t::lowest(mm)) & m]))
+          return true;
+      }
+
+      if (g.match_empty())
+        return true;
+
+      step += width;
+      pos = (pos + step) & m;
+    }
+
+    return false;
+  }
+
+  // index of key and true when found, otherwise the slot it should be
+  // emplace_at() and false. Nothing else may touch the table in between
+  template <typename KK>
+  std::pair<size_t, bool> find_or_prepare_insert(const KK &key, size_t hash) {
+    size_t i = find_index(key, hash);
+    if (i != npos)
+      return {i, true};
+
+    if (!ctrl)
+      rehash_and_grow_if_necessary();
+
+    i = find_first_non_full(hash);
+    if (growth_left == 0 && ctrl[i] == ctrl_empty) {
+      rehash_and_grow_if_necessary();
+      i = find_first_non_full(hash);
+    }
+
+    return {i, false};
+  }
+
+  template <typename... Args>
+  T &emplace_at(size_t i, size_t hash, Args &&...args) {
+    if (ctrl[i] == ctrl_empty)
+      growth_left--;
+
+    new (&slots[i]) T(std::forward<Args>(args)...);
+    set_ctrl(i, h2_of(hash));
+    count++;
+
+    return slots[i];
+  }
+
+  template <typename KK> size_t erase(const KK &key, size_t hash) {
+    size_t i = find_index(key, hash);
+    if (i == npos)
+      return 0;
+
+    erase_index(i);
+    return 1;
+  }
+
+  void clear() noexcept {
+    published.store(nullptr, std::memory_order_release);
+
+    destroy_slots();
+    free_table(ctrl);
+
+    ctrl = nullptr;
+    slots = nullptr;
+    mask = 0;
+    count = 0;
+    growth_left = 0;
+  }
+
+  void reserve(size_t n) {
+    size_t capacity = width;
+    while (max_load(capacity) < n)
+      capacity *= 2;
+
+    if (capacity > this->capacity())
+      resize(capacity);
+  }
+
+  // rehash into the smallest table that fits size(), gives memory back
+  // after a burst of inserts got erased again
+  void shrink_to_fit() {
+    if (count == 0)
+      return clear();
+
+    size_t capacity = width;
+    while (max_load(capacity) < count)
+      capacity *= 2;
+
+    if (capacity < this->capacity())
+      resize(capacity);
+  }
+
+  // slot level access for callers walking the table by index,
+  // i must be less than capacity()
+  bool full_at(size_t i) const noexcept { return is_full(ctrl[i]); }
+  T &at(size_t i) noexcept { return slots[i]; }
+  const T &at(size_t i) const noexcept { return slots[i]; }
+  void erase_at(size_t i) noexcept { erase_index(i); }
+
+  // fn(T &)
+  template <typename F> void for_each(F &&fn) {
+    for (size_t i = 0; i < capacity(); i++) {
+      if (is_full(ctrl[i]))
+        fn(slots[i]);
+    }
+  }
+};
+
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class flat_map_t {
+  struct slot_t {
+    K key;
+    V value;
+  };
+
+  struct key_of_t {
+    const K &operator()(const slot_t &s) const noexcept { return s.key; }
+  };
+
+  flat_set_t<slot_t, key_of_t, Hash, KeyEqual> table;
+
+public:
+  using key_type = K;
+  using mapped_type = V;
+
+  size_t size() const noexcept { return table.size(); }
+  bool empty() const noexcept { return table.empty(); }
+  size_t capacity() const noexcept { return table.capacity(); }
+
+  // bytes owned by the table itself, not counting heap memory owned by
+  // keys or values
+  size_t memory_usage() const noexcept { return table.memory_usage(); }
+
+  template <typename KK> static size_t hash(const KK &key) noexcept {
+    return Hash{}(key);
+  }
+
+  template <typename KK> V *find(const KK &key, size_t hash) {
+    auto *s = table.find(key, hash);
+    return s ? &s->value : nullptr;
+  }
+
+  template <typename KK> const V *find(const KK &key, size_t hash) const {
+    auto *s = table.find(key, hash);
+    return s ? &s->value : nullptr;
+  }
+
+  template <typename KK> V *find(const KK &key) {
+    return find(key, Hash{}(key));
+  }
+
+  template <typename KK> const V *find(const KK &key) const {
+    return find(key, Hash{}(key));
+  }
+
+  template <typename KK, typename VV>
+  std::pair<V *, bool> insert_or_assign(KK &&key, VV &&value, size_t hash) {
+    auto [i, found] = table.find_or_prepare_insert(key, hash);
+    if (found) {
+      auto &s = table.at(i);
+      s.value = std::forward<VV>(value);
+      return {&s.value, false};
+    }
+
+    auto &s = table.emplace_at(
+        i, hash, slot_t{K(std::forward<KK>(key)), V(std::forward<VV>(value))});
+    return {&s.value, true};
+  }
+
+  template <typename KK, typename VV>
+  std::pair<V *, bool> insert_or_assign(KK &&key, VV &&value) {
+    size_t hash = Hash{}(key);
+    return insert_or_assign(std::forward<KK>(key), std::forward<VV>(value),
+                            hash);
+  }
+
+  template <typename KK> size_t erase(const KK &key, size_t hash) {
+    return table.erase(key, hash);
+  }
+
+  template <typename KK> size_t erase(const KK &key) {
+    return erase(key, Hash{}(key));
+  }
+
+  void clear() noexcept { table.clear(); }
+  void reserve(size_t n) { table.reserve(n); }
+  void shrink_to_fit() { table.shrink_to_fit(); }
+
+  // slot level access for callers walking the table by index,
+  // i must be less than capacity()
+  bool full_at(size_t i) const noexcept { return table.full_at(i); }
+  const K &key_at(size_t i) const noexcept { return table.at(i).key; }
+  V &value_at(size_t i) noexcept { return table.at(i).value; }
+  void erase_at(size_t i) noexcept { table.erase_at(i); }
+
+  // fn(const K &, V &)
+  template <typename F> void for_each(F &&fn) {
+    table.for_each(
+        [&](slot_t &s) { fn(const_cast<const K &>(s.key), s.value); });
+  }
+};
+
+} // namespace ssplus_cache_me::flat_map
+
+#endif // FLAT_MAP_H
@@ -0,0 +1,62 @@
+#ifndef FREQUENCY_SKETCH_H
+#define FREQUENCY_SKETCH_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace ssplus_cache_me::cache {
+
+/**
+ * Count-min sketch with 4 bit saturating counters, used by the W-TinyLFU
+ * admission policy to estimate how often a key has been accessed recently.
+ *
+ * Every item maps to 4 counters (one per row), each row picking a different
+ * 64 bit word and a different nibble within it. The estimate is the smallest
+ * of the 4 counters.
+ *
+ * After sample_size increments all counters are halved so old popularity
+ * fades out (aging).
+ *
+ * increment() and frequency() may be called concurrently with each other,
+ * and with ensure_capacity() from inside an epoch::read_guard_t since a
+ * replaced table is retired. Only one thread at a time may call
+ * ensure_capacity().
+ */
+class frequency_sketch_t {
+  struct table_t {
+    size_t mask;
+    size_t sample_size;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+  };
+
+  std::atomic<table_t *> table;
+  std::atomic<size_t> additions;
+
+  static size_t index_of(const table_t &t, uint64_t hash, int row) noexcept;
+  static bool increment_at(table_t &t, size_t i, int nibble) noexcept;
+  static void reset(table_t &t) noexcept;
+
+public:
+  frequency_sketch_t();
+  ~frequency_sketch_t();
+
+  frequency_sketch_t(const frequency_sketch_t &) = delete;
+  frequency_sketch_t &operator=(const frequency_sketch_t &) = delete;
+
+  // resize for roughly max_entries distinct keys, drops all counts
+  // when the table has to grow
+  void ensure_capacity(size_t max_entries);
+
+  size_t capacity() const noexcept;
+
+  void increment(uint64_t hash) noexcept;
+
+  // estimated access count of hash, 0 to 15
+  int frequency(uint64_t hash) const noexcept;
+};
+
+} // namespace ssplus_cache_me::cache
+
+#endif // FREQUENCY_SKETCH_H
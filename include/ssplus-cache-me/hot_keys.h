@@ -0,0 +1,59 @@
+#ifndef HOT_KEYS_H
+#define HOT_KEYS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Heavy hitter keys, to tell which keys a client is hammering.
+ *
+ * Reads and writes each feed a Space-Saving summary of max_tracked
+ * counters. A key that isn't tracked takes over the smallest counter and
+ * inherits its count as error, so a key seen more than 1/max_tracked of
+ * the time is always in the summary and its count is at most error too
+ * high.
+ *
+ * Only one in sample_rate accesses is recorded, picked at random per
+ * thread, so an access costs a thread local random number most of the
+ * time. Counts are scaled back up by sample_rate.
+ *
+ * Summaries start over every window_ms, the last complete window is kept
+ * so there's always a full window to report.
+ */
+namespace ssplus_cache_me::hot_keys {
+
+enum kind_t { read = 0, write = 1 };
+
+inline constexpr uint32_t sample_rate = 64;
+inline constexpr size_t max_tracked = 256;
+inline constexpr uint64_t window_ms = 60'000;
+
+struct hot_key_t {
+  std::string key;
+  // estimated accesses in the window, already scaled by sample_rate
+  uint64_t count;
+  // count can be this much too high
+  uint64_t error;
+  // count per second of the window
+  double rate;
+};
+
+struct report_t {
+  // start of the window and how long it covers, in ms
+  uint64_t since;
+  uint64_t duration;
+  std::vector<hot_key_t> keys;
+};
+
+void record(kind_t kind, std::string_view key) noexcept;
+
+// up to limit of the hottest keys, hottest first. The current window once
+// it covers as much as the last complete one, that one otherwise
+report_t top(kind_t kind, size_t limit);
+
+} // namespace ssplus_cache_me::hot_keys
+
+#endif // HOT_KEYS_H
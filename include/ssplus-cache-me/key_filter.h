@@ -0,0 +1,54 @@
+#ifndef KEY_FILTER_H
+#define KEY_FILTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace ssplus_cache_me::cache {
+
+/**
+ * Counting bloom filter over key hashes, used to tell a key is definitely
+ * not in db without asking it.
+ *
+ * Every key maps to 4 counters of 4 bits, picked by double hashing. A key
+ * is maybe present while all 4 are non zero. As long as remove() is only
+ * called for keys added and not removed yet, there are false positives but
+ * never false negatives. A saturated counter is never decremented again
+ * since it can't know how many keys it counts anymore.
+ *
+ * Sized for a number of keys, the false positive rate stays under 1% up to
+ * that, then climbs as more keys get added.
+ *
+ * Only one thread may call add() and remove(), may_contain() can be called
+ * from any thread concurrently.
+ */
+class key_filter_t {
+  size_t mask;
+  size_t max_keys;
+  std::atomic<size_t> count;
+  std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+  void index_of(uint64_t hash, int probe, size_t &word,
+                int &offset) const noexcept;
+
+public:
+  explicit key_filter_t(size_t max_keys);
+
+  void add(uint64_t hash) noexcept;
+  void remove(uint64_t hash) noexcept;
+
+  bool may_contain(uint64_t hash) const noexcept;
+
+  // keys added and not removed
+  size_t size() const noexcept;
+  // keys it was sized for
+  size_t capacity() const noexcept;
+
+  size_t memory_usage() const noexcept;
+};
+
+} // namespace ssplus_cache_me::cache
+
+#endif // KEY_FILTER_H
@@ -0,0 +1,65 @@
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ssplus_cache_me::cache {
+
+/**
+ * Keys in order, for prefix scans the hash tables can't do.
+ *
+ * A B+-tree flattened to two levels: sorted leaves of up to
+ * max_leaf_keys keys, and a directory of leaves ordered by their first
+ * key. Lookups are a binary search in the directory and one in the leaf,
+ * a scan walks the directory from there. A full leaf splits in two,
+ * except the last one taking keys past its end, which starts a new leaf
+ * so keys added in order fill their leaves. A leaf merges into a
+ * neighbour once both fit in half a leaf.
+ *
+ * Nothing here is thread safe.
+ */
+class key_index_t {
+  struct leaf_t {
+    // sorted, never empty while in the directory
+    std::vector<std::string> keys;
+  };
+
+  std::vector<std::unique_ptr<leaf_t>> leaves;
+  size_t count = 0;
+  // heap bytes of keys too long for the string's own buffer
+  size_t key_heap_bytes = 0;
+
+  // the leaf key belongs in, the last one with a first key not after it
+  size_t leaf_of(std::string_view key) const noexcept;
+
+  std::unique_ptr<leaf_t> new_leaf() const;
+
+  void merge(size_t li);
+
+public:
+  static constexpr size_t max_leaf_keys = 128;
+
+  // false when key was already in
+  bool insert(std::string_view key);
+  // false when key wasn't in
+  bool erase(std::string_view key);
+
+  bool contains(std::string_view key) const noexcept;
+
+  // keys starting with prefix and sorting after after, in order, up to
+  // limit of them
+  std::vector<std::string> range(std::string_view prefix,
+                                 std::string_view after, size_t limit) const;
+
+  size_t size() const noexcept;
+
+  size_t memory_usage() const noexcept;
+};
+
+} // namespace ssplus_cache_me::cache
+
+#endif // KEY_INDEX_H
@@ -0,0 +1,77 @@
+#ifndef NEAR_CACHE_H
+#define NEAR_CACHE_H
+
+#include "ssplus-cache-me/cache.h"
+#include "ssplus-cache-me/frequency_sketch.h"
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ssplus_cache_me::cache {
+
+/**
+ * Small cache of the hottest keys owned by a single server thread, in
+ * front of the shared shards.
+ *
+ * Entries hold their own copy of the value so a hit only touches memory
+ * of this thread. A missed key is only admitted once its own frequency
+ * sketch saw it before, so keys read once don't push hot ones out.
+ * Eviction is CLOCK over a fixed number of slots.
+ *
+ * Nothing here is thread safe, writes to the shared cache reach other
+ * threads' near caches as erase() calls run on their own thread.
+ */
+class near_cache_t {
+  struct slot_t {
+    std::string key;
+    data_t data;
+    bool referenced = false;
+  };
+
+  // reserved once, index points into the slot keys
+  std::vector<slot_t> slots;
+  size_t max_slots;
+  std::unordered_map<std::string_view, size_t> index;
+  size_t clock_hand = 0;
+
+  frequency_sketch_t sketch;
+
+  void erase_at(size_t i);
+
+public:
+  explicit near_cache_t(size_t capacity);
+
+  near_cache_t(const near_cache_t &) = delete;
+  near_cache_t &operator=(const near_cache_t &) = delete;
+
+  // nullptr on a miss or when the entry is past its expires_at
+  const data_t *find(std::string_view key);
+
+  // copy data in when key has been missed before, replacing the least
+  // recently referenced entry when full
+  void admit(std::string_view key, const data_t &data);
+
+  void erase(std::string_view key);
+
+  // every entry with a key starting with prefix
+  void erase_prefix(std::string_view prefix);
+
+  size_t size() const noexcept;
+  size_t capacity() const noexcept;
+};
+
+using near_invalidator_t = void (*)(std::string_view key, bool prefix);
+
+// set by the servers owning near caches, so deletes not going through a
+// server thread reach them too
+void set_near_invalidator(near_invalidator_t fn) noexcept;
+
+// drop key from every near cache, or every key starting with it when
+// prefix is set. No-op until an invalidator is set
+void invalidate_near(std::string_view key, bool prefix = false);
+
+} // namespace ssplus_cache_me::cache
+
+#endif // NEAR_CACHE_H
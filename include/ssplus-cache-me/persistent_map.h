@@ -0,0 +1,250 @@
+#ifndef PERSISTENT_MAP_H
+#define PERSISTENT_MAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * Persistent hash map, a hash array mapped trie with path copying.
+ *
+ * Every node covers 5 bits of the key hash and holds up to 32 slots, each
+ * either a leaf or a child node (CHAMP layout: two bitmaps, leaves and
+ * children in separate arrays ordered by slot). Keys whose 64 bit hashes
+ * collide end up together in a node past the last level, searched
+ * linearly.
+ *
+ * Copying a map is O(1) and the copy never changes. A write copies only the
+ * nodes on its path that are shared with another copy, the ones a single
+ * map owns get changed in place. So a single writer can keep patching its
+ * map while readers on other threads hold copies taken before, as long as
+ * taking a copy is ordered before the writes that follow it (eg. both
+ * happen under the same lock).
+ */
+namespace ssplus_cache_me::persistent_map {
+
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class persistent_map_t {
+  static constexpr int bits = 5;
+  static constexpr int hash_bits = sizeof(size_t) * 8;
+
+  struct leaf_t {
+    size_t hash;
+    K key;
+    V value;
+  };
+
+  // leaves never change once made, a write replaces the whole leaf
+  using leaf_ptr = std::shared_ptr<const leaf_t>;
+
+  struct node_t;
+  using node_ptr = std::shared_ptr<node_t>;
+
+  struct node_t {
+    uint32_t datamap = 0;
+    uint32_t nodemap = 0;
+    std::vector<leaf_ptr> leaves;
+    std::vector<node_ptr> children;
+  };
+
+  node_ptr root;
+  size_t count = 0;
+
+  static uint32_t bit_of(size_t hash, int shift) noexcept {
+    return uint32_t{1} << ((hash >> shift) & 31);
+  }
+
+  static size_t index_of(uint32_t map, uint32_t bit) noexcept {
+    return __builtin_popcount(map & (bit - 1));
+  }
+
+  // make the node in slot safe to change in place, copying it when another
+  // map still holds it
+  static node_t &own(node_ptr &slot) {
+    if (!slot) {
+      slot = std::make_shared<node_t>();
+    } else if (slot.use_count() != 1) {
+      slot = std::make_shared<node_t>(*slot);
+    } else {
+      // use_count() is a relaxed load. Pairs with the release of a reader
+      // on another thread dropping its last copy, so its reads of the node
+      // happen before the writes below
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    return *slot;
+  }
+
+  // returns whether the key is new
+  static bool insert(node_ptr &slot, int shift, leaf_ptr &&leaf) {
+    node_t &n = own(slot);
+
+    // hash exhausted, collision node
+    if (shift >= hash_bits) {
+      for (auto &l : n.leaves) {
+        if (KeyEqual{}(l->key, leaf->key)) {
+          l = std::move(leaf);
+          return false;
+        }
+      }
+
+      n.leaves.push_back(std::move(leaf));
+      return true;
+    }
+
+    const uint32_t bit = bit_of(leaf->hash, shift);
+
+    if (n.datamap & bit) {
+      const size_t i = index_of(n.datamap, bit);
+      auto &l = n.leaves[i];
+
+      if (l->hash == leaf->hash && KeyEqual{}(l->key, leaf->key)) {
+        l = std::move(leaf);
+        return false;
+      }
+
+      // two keys on the same slot, push both one level down
+      node_ptr child;
+      insert(child, shift + bits, std::move(l));
+      insert(child, shift + bits, std::move(leaf));
+
+      n.leaves.erase(n.leaves.begin() + i);
+      n.datamap &= ~bit;
+
+      n.children.insert(n.children.begin() + index_of(n.nodemap, bit),
+                        std::move(child));
+      n.nodemap |= bit;
+      return true;
+    }
+
+    if (n.nodemap & bit)
+      return insert(n.children[index_of(n.nodemap, bit)], shift + bits,
+                    std::move(leaf));
+
+    n.leaves.insert(n.leaves.begin() + index_of(n.datamap, bit),
+                    std::move(leaf));
+    n.datamap |= bit;
+    return true;
+  }
+
+  // key must be in the map. slot is reset once its node is empty
+  static void remove(node_ptr &slot, int shift, size_t hash, const K &key) {
+    node_t &n = own(slot);
+
+    if (shift >= hash_bits) {
+      for (size_t i = 0; i < n.leaves.size(); i++) {
+        if (KeyEqual{}(n.leaves[i]->key, key)) {
+          n.leaves.erase(n.leaves.begin() + i);
+          break;
+        }
+      }
+    } else if (const uint32_t bit = bit_of(hash, shift); n.datamap & bit) {
+      n.leaves.erase(n.leaves.begin() + index_of(n.datamap, bit));
+      n.datamap &= ~bit;
+    } else {
+      const size_t j = index_of(n.nodemap, bit);
+      auto &child = n.children[j];
+
+      remove(child, shift + bits, hash, key);
+
+      if (!child || (child->children.empty() && child->leaves.size() == 1)) {
+        // a child left with a single leaf is replaced by the leaf
+        leaf_ptr l = child ? child->leaves[0] : nullptr;
+
+        n.children.erase(n.children.begin() + j);
+        n.nodemap &= ~bit;
+
+        if (l) {
+          n.leaves.insert(n.leaves.begin() + index_of(n.datamap, bit),
+                          std::move(l));
+          n.datamap |= bit;
+        }
+      }
+    }
+
+    if (n.leaves.empty() && n.children.empty())
+      slot = nullptr;
+  }
+
+  template <typename F> static void for_each(const node_t &n, F &fn) {
+    for (const auto &l : n.leaves)
+      fn(l->key, l->value);
+
+    for (const auto &c : n.children)
+      for_each(*c, fn);
+  }
+
+public:
+  size_t size() const noexcept { return count; }
+  bool empty() const noexcept { return count == 0; }
+
+  const V *find(const K &key) const {
+    const size_t hash = Hash{}(key);
+    const node_t *n = root.get();
+
+    for (int shift = 0; n; shift += bits) {
+      if (shift >= hash_bits) {
+        for (const auto &l : n->leaves) {
+          if (KeyEqual{}(l->key, key))
+            return &l->value;
+        }
+
+        return nullptr;
+      }
+
+      const uint32_t bit = bit_of(hash, shift);
+
+      if (n->datamap & bit) {
+        const auto &l = n->leaves[index_of(n->datamap, bit)];
+        return l->hash == hash && KeyEqual{}(l->key, key) ? &l->value
+                                                          : nullptr;
+      }
+
+      if (!(n->nodemap & bit))
+        return nullptr;
+
+      n = n->children[index_of(n->nodemap, bit)].get();
+    }
+
+    return nullptr;
+  }
+
+  // insert or replace
+  void set(K key, V value) {
+    const size_t hash = Hash{}(key);
+    auto leaf = std::make_shared<const leaf_t>(
+        leaf_t{hash, std::move(key), std::move(value)});
+
+    if (insert(root, 0, std::move(leaf)))
+      count++;
+  }
+
+  size_t erase(const K &key) {
+    if (!find(key))
+      return 0;
+
+    remove(root, 0, Hash{}(key), key);
+    count--;
+    return 1;
+  }
+
+  void clear() noexcept {
+    root = nullptr;
+    count = 0;
+  }
+
+  // fn(key, value) for every entry, in no particular order
+  template <typename F> void for_each(F &&fn) const {
+    if (root)
+      for_each(*root, fn);
+  }
+};
+
+} // namespace ssplus_cache_me::persistent_map
+
+#endif // PERSISTENT_MAP_H
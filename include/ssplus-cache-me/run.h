@@ -1,6 +1,7 @@
 #ifndef RUN_H
 #define RUN_H
 
+#include "ssplus-cache-me/cache_config.h"
 #include "ssplus-cache-me/log.h"
 #include <atomic>
 #include <condition_variable>
@@ -26,6 +27,9 @@ struct query_schedule_t {
   // skip running this query on shutdown if not on schedule
   bool must_on_schedule;
 
+  // bytes run holds on to (eg. a captured key and value), for memory stats
+  size_t payload_bytes;
+
   // stepping and finalizing is entirely user controlled
   run_fn run;
 
@@ -39,10 +43,16 @@ struct query_schedule_t {
 
   bool operator==(const query_schedule_t &o) const;
 
+  // estimated bytes held while queued
+  size_t footprint() const noexcept {
+    return sizeof(*this) + id.capacity() + query.capacity() + payload_bytes;
+  }
+
 private:
   void init() noexcept {
     ts = 0;
     must_on_schedule = false;
+    payload_bytes = 0;
   }
 };
 
@@ -71,7 +81,22 @@ class write_query_queue_t : public std::deque<query_schedule_t> {
     return beg + idx;
   }
 
+  // sum of footprint() of every query queued
+  size_t bytes = 0;
+
 public:
+  void push(const value_type &q) {
+    push_back(q);
+    bytes += q.footprint();
+  }
+
+  void remove(iterator i) {
+    bytes -= i->footprint();
+    erase(i);
+  }
+
+  size_t get_bytes() const noexcept { return bytes; }
+
   value_type &top() {
     auto i = get_top_iter();
     if (i == end())
@@ -85,7 +110,7 @@ public:
     if (i == end())
       return;
 
-    erase(i);
+    remove(i);
   }
 };
 
@@ -106,7 +131,12 @@ struct main_t {
   // program configs
   int concurrency;
 
-  main_t() : db(nullptr), concurrency(0) {}
+  // threads warming up the memory cache from db on boot, 0 disables
+  int warm_up_threads;
+
+  cache::cache_config_t cache_conf;
+
+  main_t() : db(nullptr), concurrency(0), warm_up_threads(0) {}
 
   void set_concurrency(int _concurrency) noexcept {
     static auto hwcon = std::thread::hardware_concurrency();
@@ -128,6 +158,9 @@ bool remove_query(const query_schedule_t &q) noexcept;
 
 void enqueue_write_query(const query_schedule_t &q);
 
+// queries waiting on the db writer and the sum of their footprint()
+void get_write_queue_stats(size_t &count, size_t &bytes);
+
 const char *get_exe_name() noexcept;
 
 } // namespace ssplus_cache_me
@@ -3,18 +3,33 @@
 
 #include "nlohmann/json.hpp"
 #include "ssplus-cache-me/cache.h"
+#include "ssplus-cache-me/codec.h"
 #include "ssplus-cache-me/db.h"
 #include "ssplus-cache-me/debug.h"
+#include "ssplus-cache-me/epoch.h"
+#include "ssplus-cache-me/hot_keys.h"
 #include "ssplus-cache-me/log.h"
+#include "ssplus-cache-me/near_cache.h"
+#include "ssplus-cache-me/run.h"
 #include "ssplus-cache-me/server_config.h"
+#include "ssplus-cache-me/slab.h"
 #include "ssplus-cache-me/util.h"
 #include "uWebSockets/src/App.h"
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstdlib>
 #include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <sqlite3.h>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 /*#define _DEV*/
 
@@ -27,6 +42,44 @@
 #define CORS_VALID_FOR "86400"
 #endif // CORS_VALID_FOR
 
+// ms the first GET /cache waits on the db writer to load every row before
+// scanning db on its own
+#ifndef ALL_LOAD_WAIT_MS
+#define ALL_LOAD_WAIT_MS 5000
+#endif // ALL_LOAD_WAIT_MS
+
+// keys GET /keys lists when no limit is given, and at most
+#ifndef KEYS_LIMIT
+#define KEYS_LIMIT 100
+#endif // KEYS_LIMIT
+
+#ifndef KEYS_MAX_LIMIT
+#define KEYS_MAX_LIMIT 10000
+#endif // KEYS_MAX_LIMIT
+
+// hot keys GET /stats/hot-keys lists when no limit is given, at most
+// hot_keys::max_tracked
+#ifndef HOT_KEYS_LIMIT
+#define HOT_KEYS_LIMIT 20
+#endif // HOT_KEYS_LIMIT
+
+// tags a single key can have
+#ifndef MAX_TAGS
+#define MAX_TAGS 64
+#endif // MAX_TAGS
+
+// ms a counter change waits before it's written to db, every increment
+// meanwhile lands in the same write
+#ifndef COUNTER_FLUSH_MS
+#define COUNTER_FLUSH_MS 1000
+#endif // COUNTER_FLUSH_MS
+
+// ms a get-or-set lease lasts, the holder has that long to set the key
+// before the next miss gets one
+#ifndef LEASE_TTL_MS
+#define LEASE_TTL_MS 10000
+#endif // LEASE_TTL_MS
+
 namespace ssplus_cache_me::server {
 
 inline constexpr const struct {
@@ -38,11 +91,19 @@ inline constexpr const struct {
   const char *UNAUTHORIZED_401 = "401 Unauthorized";
   const char *FORBIDDEN_403 = "403 Forbidden";
   const char *NOT_FOUND_404 = "404 Not Found";
+  const char *PRECONDITION_FAILED_412 = "412 Precondition Failed";
   const char *INTERNAL_SERVER_ERROR_500 = "500 Internal Server Error";
+  const char *SERVICE_UNAVAILABLE_503 = "503 Service Unavailable";
 } http_status_t;
 
 inline constexpr const struct {
   const char *content_type = "Content-Type";
+  const char *content_encoding = "Content-Encoding";
+  const char *vary = "Vary";
+  const char *x_cache_version = "X-Cache-Version";
+  const char *x_cache_refresh = "X-Cache-Refresh";
+  const char *x_cache_lease = "X-Cache-Lease";
+  const char *retry_after = "Retry-After";
 } header_key_t;
 
 inline constexpr const struct {
@@ -108,6 +169,16 @@ template <bool WITH_SSL> class server_t {
 
     header_v_t headers;
     std::string data;
+    // when set, written as the response body straight from the cache buffer
+    // instead of data
+    cache::value_t body;
+    // written as the body when body and data are empty, for a buffer that
+    // outlives the response
+    std::string_view view;
+
+    // headers written as they are, without going through headers
+    bool json = false;
+    std::optional<uint64_t> cache_version;
 
     http_response_t &reset(uws_response_t *_res = nullptr) {
       if (_res)
@@ -118,6 +189,10 @@ template <bool WITH_SSL> class server_t {
 
       headers.clear();
       data.clear();
+      body = {};
+      view = {};
+      json = false;
+      cache_version.reset();
       return *this;
     }
 
@@ -139,10 +214,20 @@ template <bool WITH_SSL> class server_t {
       if (!headers.empty())
         write_headers(res, headers);
 
-      if (data.empty())
-        res->end();
-      else
+      if (json)
+        set_content_type_json(res);
+
+      if (cache_version)
+        res->writeHeader(header_key_t.x_cache_version, *cache_version);
+
+      if (!body.empty())
+        res->end(body.view());
+      else if (!data.empty())
         res->end(data);
+      else if (!view.empty())
+        res->end(view);
+      else
+        res->end();
 
       res = nullptr;
     }
@@ -162,6 +247,21 @@ template <bool WITH_SSL> class server_t {
       return *this;
     }
 
+    http_response_t &set_data(std::string &&_data) {
+      data = std::move(_data);
+      return *this;
+    }
+
+    http_response_t &set_body(const cache::value_t &_body) {
+      body = _body;
+      return *this;
+    }
+
+    http_response_t &set_view(std::string_view _view) {
+      view = _view;
+      return *this;
+    }
+
     http_response_t &set_data(const nlohmann::json &_data) {
       return set_data(_data.dump());
     }
@@ -180,8 +280,9 @@ template <bool WITH_SSL> class server_t {
     const char *what() const noexcept { return msg.c_str(); };
   };
 
+  // the bool is whether the payload asks for a lease, see parse_lease()
   using post_cache_custom_handler_fn =
-      std::function<bool(http_response_t &, cache_data_t &)>;
+      std::function<bool(http_response_t &, cache_data_t &, bool)>;
 
   ////////////////////////////////////////
 
@@ -200,6 +301,24 @@ template <bool WITH_SSL> class server_t {
   uWS::Loop *sloop;
   us_listen_socket_t *slisten_socket;
 
+  // hottest keys of this thread, null when disabled. Only touched by the
+  // server thread
+  std::unique_ptr<cache::near_cache_t> l1;
+
+  // keys written by other threads, erased from l1 by drain_l1()
+  struct l1_invalid_t {
+    std::string key;
+    // every key starting with key
+    bool prefix;
+  };
+
+  std::mutex l1_m;
+  std::vector<l1_invalid_t> l1_invalid;
+
+  // servers with a near cache, invalidate_l1() sends keys to them
+  static inline std::shared_mutex l1_servers_m;
+  static inline std::vector<server_t *> l1_servers;
+
   static inline const header_v_t cors_default_additional_headers = {
       {"Access-Control-Expose-Headers", "Content-Length,Content-Range"}};
 
@@ -299,15 +418,99 @@ template <bool WITH_SSL> class server_t {
     });
 
     sloop = uWS::Loop::get();
+
+    // nothing read from the cache outlives a loop iteration, report that
+    // before the loop blocks waiting for events so memory the cache
+    // retired can be freed. Lock free cache reads only pay for going
+    // online once per iteration this way
+    epoch::register_thread();
+    sloop->addPreHandler(this, [](uWS::Loop *) { epoch::quiescent(); });
+
+    if (conf.l1_entries) {
+      l1 = std::make_unique<cache::near_cache_t>(conf.l1_entries);
+
+      std::lock_guard lk(l1_servers_m);
+      l1_servers.push_back(this);
+
+      cache::set_near_invalidator(&server_t::invalidate_every_l1);
+    }
   }
 
   void run() {
     sapp->run();
 
+    // nothing may defer to this loop anymore
+    if (l1) {
+      std::lock_guard lk(l1_servers_m);
+      l1_servers.erase(
+          std::find(l1_servers.begin(), l1_servers.end(), this));
+    }
+
+    sloop->removePreHandler(this);
+    epoch::unregister_thread();
+
     delete sapp;
     sapp = nullptr;
   }
 
+  void drain_l1() {
+    std::vector<l1_invalid_t> keys;
+
+    {
+      std::lock_guard lk(l1_m);
+      keys.swap(l1_invalid);
+    }
+
+    for (const auto &k : keys) {
+      if (k.prefix)
+        l1->erase_prefix(k.key);
+      else
+        l1->erase(k.key);
+    }
+  }
+
+  // queue key for s to drop from its near cache on its own thread
+  static void send_l1_invalid(server_t *s, std::string_view key,
+                              bool prefix) {
+    std::lock_guard lk(s->l1_m);
+
+    // a single drain per batch of keys
+    if (s->l1_invalid.empty())
+      s->defer([s] { s->drain_l1(); });
+
+    s->l1_invalid.push_back({std::string(key), prefix});
+  }
+
+  // key got set or deleted in the shared cache, or every key starting with
+  // it when prefix is set. Other threads drop it from their near cache on
+  // their next loop iteration, after any request they were serving with
+  // the old value
+  void invalidate_l1(std::string_view key, bool prefix = false) {
+    if (!l1)
+      return;
+
+    if (prefix)
+      l1->erase_prefix(key);
+    else
+      l1->erase(key);
+
+    std::shared_lock lk(l1_servers_m);
+
+    for (auto *s : l1_servers) {
+      if (s != this)
+        send_l1_invalid(s, key, prefix);
+    }
+  }
+
+  // same as invalidate_l1() from a thread that is no server, like the db
+  // writer. See cache::invalidate_near()
+  static void invalidate_every_l1(std::string_view key, bool prefix) {
+    std::shared_lock lk(l1_servers_m);
+
+    for (auto *s : l1_servers)
+      send_l1_invalid(s, key, prefix);
+  }
+
   void shutdown_server() {
     if (sapp)
       defer([this] { sapp->close(); });
@@ -354,6 +557,9 @@ template <bool WITH_SSL> class server_t {
     auto get_cache = [this](uws_response_t *res, uws_request_t *req) {
       endpoint_bench_t bench("GET /cache/:key");
 
+      static codec::stats_t codec_stats("GET /cache/:key");
+      codec::scope_t codec_scope(codec_stats);
+
       auto cors_headers = cors(res, req);
       if (cors_headers.empty())
         return;
@@ -366,14 +572,18 @@ template <bool WITH_SSL> class server_t {
         return;
       }
 
-      std::string str_key(key);
-
-      http_handlers::get_cache(hres, str_key, db_conn, id);
+      http_handlers::get_cache(
+          hres, key, db_conn, id,
+          codec::accepts_gzip(req->getHeader("accept-encoding")), l1.get(),
+          parse_xfetch(req->getQuery("xfetch")));
     };
 
     auto get_all_cache = [this](uws_response_t *res, uws_request_t *req) {
       endpoint_bench_t bench("GET /cache");
 
+      static codec::stats_t codec_stats("GET /cache");
+      codec::scope_t codec_scope(codec_stats);
+
       auto cors_headers = cors(res, req);
       if (cors_headers.empty())
         return;
@@ -390,7 +600,9 @@ template <bool WITH_SSL> class server_t {
       if (cors_headers.empty())
         return;
 
-      http_handlers::post_cache(res, cors_headers, bench);
+      static codec::stats_t codec_stats("POST /cache");
+
+      http_handlers::post_cache(*this, res, cors_headers, bench, codec_stats);
     };
 
     auto get_post_cache = [this](uws_response_t *res, uws_request_t *req) {
@@ -400,14 +612,30 @@ template <bool WITH_SSL> class server_t {
       if (cors_headers.empty())
         return;
 
+      static codec::stats_t codec_stats("POST /cache/get-or-set");
+
+      const bool gzip_ok =
+          codec::accepts_gzip(req->getHeader("accept-encoding"));
+      const double xfetch = parse_xfetch(req->getQuery("xfetch"));
+
       http_handlers::post_cache(
-          res, cors_headers, bench,
-          [this](http_response_t &hres, cache_data_t &data) -> bool {
-            if (http_handlers::get_cache(hres, data.first, db_conn, id) == 0)
+          *this, res, cors_headers, bench, codec_stats,
+          [this, gzip_ok, xfetch](http_response_t &hres, cache_data_t &data,
+                                  bool lease) -> bool {
+            if (http_handlers::get_cache(hres, data.first, db_conn, id,
+                                         gzip_ok, l1.get(), xfetch) == 0)
               return true;
 
             hres.reset(hres.res);
-            return false;
+            if (!lease)
+              return false;
+
+            // set since the miss, answer with it this time
+            if (!http_handlers::respond_lease(hres, data.first))
+              http_handlers::get_cache(hres, data.first, db_conn, id, gzip_ok,
+                                       l1.get(), xfetch);
+
+            return true;
           });
     };
 
@@ -425,21 +653,299 @@ template <bool WITH_SSL> class server_t {
         return;
       }
 
-      std::string str_key(key);
-
       // - Delete cache in mem
       // - Delete cache in db
       // - Mark skip any schedule with
       //   ID key (already handled by db::delete_cache())
-      cache::del(str_key);
-      db::delete_cache(str_key);
+      cache::del(key);
+      invalidate_l1(key);
+      db::delete_cache(std::string(key));
 
       set_content_type_json(hres);
       // DELETE should response with 204 No Content
       hres.set_status(http_status_t.NO_CONTENT_204);
     };
 
+    // GET /keys?prefix=<p>&limit=<n>&after=<key>, keys in order. next is
+    // the after of the next page, null on the last one
+    auto get_keys = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("GET /keys");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      const size_t limit =
+          parse_limit(req->getQuery("limit"), KEYS_LIMIT, KEYS_MAX_LIMIT);
+
+      auto keys = cache::list_keys(req->getQuery("prefix").value_or(""),
+                                   req->getQuery("after").value_or(""),
+                                   limit);
+
+      nlohmann::json next = nullptr;
+      if (limit != 0 && keys.size() == limit)
+        next = keys.back();
+
+      set_content_type_json(hres);
+      hres.set_data(
+          json_response::success({{"keys", std::move(keys)}, {"next", next}}));
+    };
+
+    // DELETE /cache?prefix=<p>
+    auto delete_cache_prefix = [this](uws_response_t *res,
+                                      uws_request_t *req) {
+      endpoint_bench_t bench("DELETE /cache?prefix");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      // an empty prefix would be every key
+      auto prefix = req->getQuery("prefix").value_or("");
+      if (prefix.empty()) {
+        hres.set_status(http_status_t.BAD_REQUEST_400);
+        return;
+      }
+
+      // queued before the memory entries go, so a set racing this either
+      // got queued before and is deleted from both, or lands in db after
+      db::delete_prefix(std::string(prefix));
+      cache::del_prefix(prefix);
+      invalidate_l1(prefix, true);
+
+      hres.set_status(http_status_t.NO_CONTENT_204);
+    };
+
+    // POST /cache/incr/:key?by=<n>&ttl=<ms>, by defaults to 1. ttl
+    // replaces the expiry, none keeps it
+    auto incr_cache = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("POST /cache/incr/:key");
+      http_handlers::incr_cache(*this, res, req, false);
+    };
+
+    auto decr_cache = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("POST /cache/decr/:key");
+      http_handlers::incr_cache(*this, res, req, true);
+    };
+
+    // every key tagged with :tag
+    auto delete_tag = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("DELETE /tags/:tag");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      auto tag = std::string(req->getParameter(0));
+      if (tag.empty()) {
+        hres.set_status(http_status_t.BAD_REQUEST_400);
+        return;
+      }
+
+      // keys in db with the tag, the db writer drops the ones it persists
+      // meanwhile. Queued first for the same reason as the prefix delete
+      auto keys = cache::tagged_keys(tag);
+      db::delete_tag(tag);
+
+      for (const auto &k : keys) {
+        cache::del(k);
+        invalidate_l1(k);
+      }
+
+      hres.set_status(http_status_t.NO_CONTENT_204);
+    };
+
     // stat endpoints
+    auto get_stats_compression = [this](uws_response_t *res,
+                                        uws_request_t *req) {
+      endpoint_bench_t bench("GET /stats/compression");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      auto ratio = [](uint64_t in, uint64_t out) -> double {
+        return in ? static_cast<double>(out) / in : 0;
+      };
+
+      auto avg = [](uint64_t total, uint64_t n) -> uint64_t {
+        return n ? total / n : 0;
+      };
+
+      nlohmann::json endpoints = nlohmann::json::array();
+      for (const auto *st : codec::get_stats()) {
+        const uint64_t c = st->compressed.load(std::memory_order_relaxed);
+        const uint64_t c_in = st->compressed_in.load(std::memory_order_relaxed);
+        const uint64_t c_out =
+            st->compressed_out.load(std::memory_order_relaxed);
+        const uint64_t c_ns = st->compress_ns.load(std::memory_order_relaxed);
+
+        const uint64_t d = st->decompressed.load(std::memory_order_relaxed);
+        const uint64_t d_in =
+            st->decompressed_in.load(std::memory_order_relaxed);
+        const uint64_t d_out =
+            st->decompressed_out.load(std::memory_order_relaxed);
+        const uint64_t d_ns = st->decompress_ns.load(std::memory_order_relaxed);
+
+        endpoints.push_back(
+            {{"endpoint", st->endpoint},
+             {"compress",
+              {{"count", c},
+               {"bytes_in", c_in},
+               {"bytes_out", c_out},
+               {"ratio", ratio(c_in, c_out)},
+               {"ns", c_ns},
+               {"avg_ns", avg(c_ns, c)}}},
+             {"decompress",
+              {{"count", d},
+               {"bytes_in", d_in},
+               {"bytes_out", d_out},
+               {"ratio", ratio(d_out, d_in)},
+               {"ns", d_ns},
+               {"avg_ns", avg(d_ns, d)}}},
+             {"passthrough", st->passthrough.load(std::memory_order_relaxed)}});
+      }
+
+      set_content_type_json(hres);
+      hres.set_data(json_response::success(endpoints));
+    };
+
+    auto get_stats_memory = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("GET /stats/memory");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      const auto m = cache::get_memory_stats();
+
+      size_t queries, queue_bytes;
+      get_write_queue_stats(queries, queue_bytes);
+
+      size_t statements, stmt_bytes;
+      db::get_stmt_cache_stats(statements, stmt_bytes);
+
+      set_content_type_json(hres);
+      hres.set_data(json_response::success(
+          {{"cache",
+            {{"entries", m.entries},
+             {"key_bytes", m.key_bytes},
+             {"value_bytes", m.value_bytes},
+             {"overhead", m.overhead},
+             {"total", m.key_bytes + m.value_bytes + m.overhead},
+             {"loads", m.loads},
+             {"leases", m.leases}}},
+           {"view",
+            {{"loaded", m.view_loaded},
+             {"rows", m.view_rows},
+             {"bytes", m.view_bytes}}},
+           {"key_filter", {{"keys", m.filter_keys}, {"bytes", m.filter_bytes}}},
+           {"key_index", {{"keys", m.index_keys}, {"bytes", m.index_bytes}}},
+           {"tags",
+            {{"tags", m.tags},
+             {"tagged", m.tagged},
+             {"bytes", m.tags_bytes}}},
+           {"write_queue", {{"queries", queries}, {"bytes", queue_bytes}}},
+           {"stmt_cache", {{"statements", statements}, {"bytes", stmt_bytes}}},
+           {"epoch",
+            {{"pending", epoch::get_pending_count()},
+             {"bytes", epoch::get_pending_bytes()}}},
+           {"sqlite", {{"bytes", sqlite3_memory_used()}}}}));
+    };
+
+    auto get_stats_slab = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("GET /stats/slab");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      nlohmann::json classes = nlohmann::json::array();
+      for (const auto &c : slab::get_class_stats()) {
+        // class never used
+        if (c.reserved_bytes == 0)
+          continue;
+
+        classes.push_back(
+            {{"size", c.object_size},
+             {"reserved", c.reserved_bytes},
+             {"used", c.used_objects},
+             {"utilization", static_cast<double>(c.used_objects *
+                                                 c.object_size) /
+                                 c.reserved_bytes}});
+      }
+
+      set_content_type_json(hres);
+      hres.set_data(json_response::success(
+          {{"huge_pages", slab::huge_pages()},
+           {"reserved", slab::get_reserved_bytes()},
+           {"large", slab::get_large_bytes()},
+           {"classes", classes}}));
+    };
+
+    // GET /stats/hot-keys?limit=<n>
+    auto get_stats_hot_keys = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("GET /stats/hot-keys");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      const size_t limit = parse_limit(req->getQuery("limit"), HOT_KEYS_LIMIT,
+                                       hot_keys::max_tracked);
+
+      auto to_json = [](const hot_keys::report_t &r) {
+        nlohmann::json keys = nlohmann::json::array();
+        for (const auto &k : r.keys)
+          keys.push_back({{"key", k.key},
+                          {"count", k.count},
+                          {"error", k.error},
+                          {"rate", k.rate}});
+
+        return nlohmann::json{
+            {"since", r.since}, {"duration", r.duration}, {"keys", keys}};
+      };
+
+      set_content_type_json(hres);
+      hres.set_data(json_response::success(
+          {{"sample_rate", hot_keys::sample_rate},
+           {"reads", to_json(hot_keys::top(hot_keys::read, limit))},
+           {"writes", to_json(hot_keys::top(hot_keys::write, limit))}}));
+    };
+
+    // for load balancers, 503 until the memory cache is warmed up
+    auto get_ready = [this](uws_response_t *res, uws_request_t *req) {
+      endpoint_bench_t bench("GET /ready");
+
+      auto cors_headers = cors(res, req);
+      if (cors_headers.empty())
+        return;
+
+      http_response_t hres(res, cors_headers);
+
+      const bool ready = db::warm();
+      if (!ready)
+        hres.set_status(http_status_t.SERVICE_UNAVAILABLE_503);
+
+      set_content_type_json(hres);
+      hres.set_data(json_response::success(
+          {{"ready", ready}, {"warmed_rows", db::warmed_rows()}}));
+    };
+
     // auto get_checkhealth = [this](uws_response_t *res, uws_request_t *req) {
     //   auto cors_headers = cors(res, req);
     //   if (cors_headers.empty())
@@ -466,8 +972,15 @@ template <bool WITH_SSL> class server_t {
     sapp->options("/*", options_cors);
     sapp->head("/*", options_cors);
 
-    // TODO: how do we implement these?
     // stat endpoints
+    sapp->get("/stats/slab", get_stats_slab);
+    sapp->get("/stats/memory", get_stats_memory);
+    sapp->get("/stats/compression", get_stats_compression);
+    sapp->get("/stats/hot-keys", get_stats_hot_keys);
+
+    sapp->get("/ready", get_ready);
+
+    // TODO: how do we implement these?
     // sapp->get("/checkhealth", get_checkhealth);
 
     // log triggers
@@ -483,7 +996,12 @@ template <bool WITH_SSL> class server_t {
     sapp->get("/cache", get_all_cache); // bonus endpoint?
     sapp->post("/cache", post_cache);
     sapp->post("/cache/get-or-set", get_post_cache);
+    sapp->post("/cache/incr/:key", incr_cache);
+    sapp->post("/cache/decr/:key", decr_cache);
     sapp->del("/cache/:key", delete_cache);
+    sapp->del("/cache", delete_cache_prefix);
+    sapp->get("/keys", get_keys);
+    sapp->del("/tags/:tag", delete_tag);
 #else
     // SS Production compatible routing
 
@@ -498,6 +1016,11 @@ template <bool WITH_SSL> class server_t {
     sapp->get("/api/caches/key/:key", get_cache);
     sapp->del("/api/caches/:key", delete_cache);
     sapp->post("/api/caches/get-or-set", get_post_cache);
+    sapp->post("/api/caches/incr/:key", incr_cache);
+    sapp->post("/api/caches/decr/:key", decr_cache);
+    sapp->del("/api/caches", delete_cache_prefix);
+    sapp->get("/api/caches/keys", get_keys);
+    sapp->del("/api/caches/tags/:tag", delete_tag);
 #endif // SS_COMP
   }
 
@@ -648,12 +1171,72 @@ public:
     return headers;
   }
 
+  // a ?limit=<n> query value, fallback when it's missing or not a number
+  // and capped at max
+  static inline size_t parse_limit(std::optional<std::string_view> v,
+                                   size_t fallback, size_t max) noexcept {
+    if (!v || v->empty())
+      return fallback;
+
+    size_t ret = 0;
+    for (char c : *v) {
+      if (c < '0' || c > '9')
+        return fallback;
+
+      ret = ret * 10 + (c - '0');
+      if (ret > max)
+        return max;
+    }
+
+    return ret;
+  }
+
+  // unsigned decimal number v into out, false when it isn't one or is over
+  // max
+  static inline bool parse_uint(std::string_view v, uint64_t max,
+                                uint64_t &out) noexcept {
+    if (v.empty())
+      return false;
+
+    uint64_t ret = 0;
+    for (char c : v) {
+      if (c < '0' || c > '9')
+        return false;
+
+      ret = ret * 10 + (c - '0');
+      if (ret > max)
+        return false;
+    }
+
+    out = ret;
+    return true;
+  }
+
+  // beta of the early refresh a GET asks for with ?xfetch, 1 when it's
+  // given without one. 0 turns it off, so does anything but a positive
+  // number
+  static inline double parse_xfetch(std::optional<std::string_view> v) {
+    if (!v)
+      return 0;
+
+    if (v->empty())
+      return 1;
+
+    const std::string s(*v);
+    char *end = nullptr;
+    const double ret = std::strtod(s.c_str(), &end);
+
+    return end == s.c_str() + s.size() && std::isfinite(ret) && ret > 0
+               ? ret
+               : 0;
+  }
+
   static inline void set_content_type_json(uws_response_t *res) {
     res->writeHeader(header_key_t.content_type, content_type_t.json);
   }
 
   static inline void set_content_type_json(http_response_t &hres) {
-    hres.headers.emplace_back(header_key_t.content_type, content_type_t.json);
+    hres.json = true;
   }
 
   static inline void write_headers(uws_response_t *res,
@@ -705,13 +1288,19 @@ public:
    * - `ttl`: (number) Time-to-live for the cache entry, a duration
    *                   in millisecond eg. 600000 for 10 minutes.
    * - `value`: (string) The data to store in the cache.
+   * - `delta`: (number) Optional ms the value takes to recompute, for
+   *                     early refresh. Capped at 65535.
    *
    * `key` and `value` must not be empty.
    * If `ttl` is empty then the cache will live forever until the end of the
    * universe.
+   *
+   * `value` is moved out of payload into the cache buffer. Without
+   * need_value a payload may leave it out.
    */
   static inline std::pair<std::string, cache::data_t>
-  parse_to_cache_data(const nlohmann::json &payload, uint64_t ttl_base = 0) {
+  parse_to_cache_data(nlohmann::json &payload, uint64_t ttl_base = 0,
+                      bool need_value = true) {
     if (!payload.is_object())
       throw http_error_t("Malformed data");
 
@@ -725,8 +1314,10 @@ public:
     }
 
     auto iv = payload.find("value");
-    if (iv == payload.end() || !iv->is_string() ||
-        (ret.value = iv->get<std::string>()).empty()) {
+    if ((iv != payload.end() || need_value) &&
+        (iv == payload.end() || !iv->is_string() ||
+         (ret.value = cache::value_t(std::move(iv->get_ref<std::string &>())))
+             .empty())) {
       throw http_error_t("Invalid value");
     }
 
@@ -745,9 +1336,116 @@ public:
       }
     }
 
+    auto idelta = payload.find("delta");
+    if (idelta != payload.end()) {
+      if (!idelta->is_number_unsigned())
+        throw http_error_t("Invalid delta");
+
+      ret.delta = static_cast<uint16_t>(
+          std::min<uint64_t>(idelta->get<uint64_t>(), UINT16_MAX));
+    }
+
     return {key, ret};
   }
 
+  /**
+   * @brief Parse the optional `tags` of a cache payload, an array of non
+   * empty strings. At most MAX_TAGS of them, duplicates are dropped.
+   *
+   * A set replaces every tag the key had, no `tags` leaves it untagged.
+   */
+  static inline std::vector<std::string>
+  parse_tags(const nlohmann::json &payload) {
+    std::vector<std::string> ret;
+
+    auto it = payload.find("tags");
+    if (it == payload.end())
+      return ret;
+
+    if (!it->is_array() || it->size() > MAX_TAGS)
+      throw http_error_t("Invalid tags");
+
+    for (const auto &t : *it) {
+      if (!t.is_string() || t.get_ref<const std::string &>().empty())
+        throw http_error_t("Invalid tags");
+
+      const auto &tag = t.get_ref<const std::string &>();
+      if (std::find(ret.begin(), ret.end(), tag) == ret.end())
+        ret.push_back(tag);
+    }
+
+    return ret;
+  }
+
+  /**
+   * @brief Parse the optional write conditions of a cache payload:
+   * - `nx`: (bool) Only set when the key has no value.
+   * - `xx`: (bool) Only set when the key has a value.
+   * - `if_version`: (number) Only set when the key's value has this
+   *                         version, 0 for a value from before versions.
+   * - `lease_token`: (number) Only set with this lease on the key, from
+   *                          a get-or-set asking for one.
+   *
+   * `nx` can't go with `xx` or `if_version`.
+   */
+  static inline cache::set_condition_t
+  parse_condition(const nlohmann::json &payload) {
+    cache::set_condition_t ret;
+
+    auto flag = [&payload](const char *name) {
+      auto it = payload.find(name);
+      if (it == payload.end())
+        return false;
+
+      if (!it->is_boolean())
+        throw http_error_t("Invalid condition");
+
+      return it->get<bool>();
+    };
+
+    ret.nx = flag("nx");
+    ret.xx = flag("xx");
+
+    auto it = payload.find("if_version");
+    if (it != payload.end()) {
+      if (!it->is_number_unsigned())
+        throw http_error_t("Invalid condition");
+
+      ret.if_version = it->get<uint64_t>();
+    }
+
+    auto il = payload.find("lease_token");
+    if (il != payload.end()) {
+      if (!il->is_number_unsigned())
+        throw http_error_t("Invalid condition");
+
+      ret.lease = il->get<uint64_t>();
+    }
+
+    if (ret.nx && (ret.xx || ret.if_version))
+      throw http_error_t("Invalid condition");
+
+    return ret;
+  }
+
+  /**
+   * @brief Parse the optional `lease` of a get-or-set payload, true asks for
+   * a lease on a miss instead of setting `value`, which can be left out.
+   */
+  static inline bool parse_lease(const nlohmann::json &payload) {
+    if (!payload.is_object())
+      return false;
+
+    auto it = payload.find("lease");
+    if (it == payload.end())
+      return false;
+
+    if (!it->is_boolean())
+      throw http_error_t("Invalid lease");
+
+    return it->get<bool>();
+  }
+
   ////////////////////////////////////////
 
   // util json_response //////////////////
@@ -765,97 +1463,320 @@ public:
     static inline nlohmann::json error(int c, const std::string &msg) {
       return create_payload(false, c, {{"message", msg}});
     }
+
+    // same output as dumping the json object GET /cache used to build out
+    // of a vector ("0": {"ExpiresAt", "Value"}, ...), written straight from
+    // the pinned rows so it costs O(response size)
+    static inline std::string all_to_json(const cache::all_data_t &all) {
+      const uint64_t now = util::get_current_ts();
+      auto live = [now](const cache::data_t &d) {
+        const uint64_t eat = d.get_expires_at();
+        return eat == 0 || eat > now;
+      };
+
+      size_t n = 0;
+      size_t bytes = 0;
+      all.for_each([&](const std::string &, const cache::data_t &d) {
+        if (live(d)) {
+          n++;
+          bytes += d.value.size() + 48;
+        }
+      });
+
+      std::string ret;
+      ret.reserve(bytes + 64);
+
+#ifndef SS_COMP
+      ret += "{\"code\":0,\"data\":{";
+#else
+      ret += "{";
+#endif // SS_COMP
+
+      // json object keys are sorted as strings, so hand out the indexes in
+      // that order: 0, 1, 10, 100, ..., 11, ..., 2, ...
+      size_t i = 0;
+      size_t done = 0;
+      all.for_each([&](const std::string &, const cache::data_t &d) {
+        if (!live(d) || done == n)
+          return;
+
+        if (done++ != 0) {
+          ret += ',';
+
+          if (i == 0)
+            i = 1;
+          else if (i * 10 < n)
+            i *= 10;
+          else {
+            while (i % 10 == 9 || i + 1 >= n)
+              i /= 10;
+            i++;
+          }
+        }
+
+        ret += '"';
+        ret += std::to_string(i);
+        ret += "\":{\"ExpiresAt\":";
+        ret += std::to_string(d.get_expires_at());
+        ret += ",\"Value\":\"";
+        util::json_escape(ret, d.plain().view());
+        ret += "\"}";
+      });
+
+#ifndef SS_COMP
+      ret += "},\"success\":true}";
+#else
+      ret += "}";
+#endif // SS_COMP
+
+      return ret;
+    }
+
+    // same output as success(d.to_json()).dump(), escaping the value
+    // straight from the cache buffer. Appended to out
+    static inline void success(std::string &out, const cache::data_t &d) {
+      out.reserve(out.size() + d.value.size() + 64);
+
+      out += "{\"code\":0,\"data\":";
+      d.dump_json(out);
+      out += ",\"success\":true}";
+    }
+
+    static inline std::string success(const cache::data_t &d) {
+      std::string ret;
+      success(ret, d);
+      return ret;
+    }
   };
 
   ////////////////////////////////////////
 
   struct http_handlers {
-    static inline int get_cache(http_response_t &hres,
-                                const std::string &str_key, sqlite3 *db_conn,
-                                int server_id) {
-      if (str_key.empty()) {
+    // gzip_ok is whether the client accepts a gzip Content-Encoding. l1 is
+    // the near cache of the calling server, if any. xfetch is the beta of
+    // cache::refresh_early(), 0 never tells the caller to refresh
+    static inline int get_cache(http_response_t &hres, std::string_view key,
+                                sqlite3 *db_conn, int server_id,
+                                bool gzip_ok = false,
+                                cache::near_cache_t *l1 = nullptr,
+                                double xfetch = 0) {
+      if (key.empty()) {
         // get all cache entry and returns early here
         auto cached = cache::get_all();
         if (cached.second == false) {
-          // cache vector isn't populated,
-          // fetch from db
-          cached.first = db::get_all_cache(db_conn, server_id);
-
-          cached = cache::set_all(cached.first, true);
+          // first request, have the db writer load it so every write queued
+          // after keeps it up to date
+          db::load_all_cache();
+          cached = cache::wait_all(std::chrono::milliseconds(ALL_LOAD_WAIT_MS));
+
+          // writer is too far behind, answer straight from db this time
+          if (cached.second == false)
+            cached.first = db::get_all_cache(db_conn, server_id);
         }
 
         set_content_type_json(hres);
 
-        nlohmann::json data = nlohmann::json::object();
-        for (size_t i = 0; i < cached.first.size(); i++) {
-          const auto &d = cached.first.at(i);
-          // "Value","ExpiresAt"
-          data[std::to_string(i)] = {{"Value", d.value},
-                                     {"ExpiresAt", d.get_expires_at()}};
-        }
+        hres.set_data(json_response::all_to_json(cached.first));
+
+        return 0;
+      }
+
+      // key is not in cache but might be in db,
+      // try to find it there and cache it. Other threads missing it
+      // meanwhile wait for this load
+      hot_keys::record(hot_keys::read, key);
+
+      // hot keys never leave this thread
+      if (const cache::data_t *near = l1 ? l1->find(key) : nullptr)
+        return respond_cache(hres, key, *near, gzip_ok, xfetch);
 
-        hres.set_data(
+      auto cached = cache::get_or_load(
+          key, [&]() { return load_cache(db_conn, key, server_id); });
+
+      if (cached.empty()) {
+        // cache not found
+        hres.set_status(http_status_t.NOT_FOUND_404);
+        return 2;
+      }
+
+      if (l1)
+        l1->admit(key, cached);
+
+      return respond_cache(hres, key, cached, gzip_ok, xfetch);
+    }
+
+    // key read from db for the cache, empty when it's missing or expired
+    static inline cache::data_t load_cache(sqlite3 *db_conn,
+                                           std::string_view key,
+                                           int server_id) {
+      auto loaded = db::get_cache(db_conn, key, server_id);
+
+      auto eat = loaded.get_expires_at();
+      if (eat != 0) {
+        // schedule deletion
+        db::delete_cache(std::string(key), eat);
+
+        // don't response with expired cache
+        if (eat <= util::get_current_ts())
+          loaded.clear();
+      }
+
+      return loaded;
+    }
+
+    static inline int respond_cache(http_response_t &hres,
+                                    std::string_view key,
+                                    const cache::data_t &cached, bool gzip_ok,
+                                    double xfetch = 0) {
+      set_content_type_json(hres);
+      hres.cache_version = cached.version;
+
+      // this caller recomputes the value, everyone else keeps getting it
+      if (xfetch > 0 && cache::refresh_early(key, cached, xfetch))
+        hres.headers.emplace_back(header_key_t.x_cache_refresh, "1");
 #ifndef SS_COMP
-            json_response::success(data)
+      // the value is escaped into the json, has to be decompressed
+      (void)gzip_ok;
+
+      // every hit of this thread reuses its capacity, hres is done with it
+      // before the next request
+      static thread_local std::string buf;
+      buf.clear();
+      json_response::success(buf, cached);
+      hres.set_view(buf);
 #else
-            data
-#endif // SS_COMP
-        );
-
+      if (!cached.compressed()) {
+        hres.set_body(cached.value);
         return 0;
       }
 
-      auto cached = cache::get(str_key);
-      if (!cached.cached()) {
-        // key is not in cache
-        // try to find it in db and cache it
-        cached = db::get_cache(db_conn, str_key, server_id);
+      hres.headers.emplace_back(header_key_t.vary, "Accept-Encoding");
 
-        auto eat = cached.get_expires_at();
-        if (eat != 0) {
-          // schedule deletion
-          db::delete_cache(str_key, eat);
+      if (gzip_ok && cached.codec == codec::gzip) {
+        // stored as a gzip member already
+        hres.headers.emplace_back(header_key_t.content_encoding, "gzip");
+        hres.set_body(cached.value);
+        codec::count_passthrough();
+      } else {
+        hres.set_body(cached.plain());
+      }
+#endif // SS_COMP
+      return 0;
+    }
 
-          // don't response with expired cache
-          if (eat <= util::get_current_ts())
-            cached.clear();
-        }
+    // the value of a counter is its decimal integer, set straight in memory
+    // without a body to parse. Its db write is coalesced, see
+    // db::flush_counter()
+    static inline void incr_cache(server_t &srv, uws_response_t *res,
+                                  uws_request_t *req, bool decr) {
+      auto cors_headers = srv.cors(res, req);
+      if (cors_headers.empty())
+        return;
 
-        if (cached.empty()) {
-          cached.mark_cached();
-        }
+      http_response_t hres(res, cors_headers);
 
-        cache::set(str_key, cached);
+      const auto key = std::string(req->getParameter(0));
+      uint64_t by = 1;
+      uint64_t ttl = 0;
+
+      // both stay far enough from overflowing once added to
+      const uint64_t max = std::numeric_limits<int64_t>::max();
+      const auto qby = req->getQuery("by");
+      const auto qttl = req->getQuery("ttl");
+
+      if (key.empty() || (qby && !parse_uint(*qby, max, by)) ||
+          (qttl && !parse_uint(*qttl, max, ttl))) {
+        hres.set_status(http_status_t.BAD_REQUEST_400);
+        return;
       }
 
-      if (cached.expires_at == 1) {
-        // cache not found
-        hres.set_status(http_status_t.NOT_FOUND_404);
-        return 2;
+      hot_keys::record(hot_keys::write, key);
+
+      const int64_t delta =
+          decr ? -static_cast<int64_t>(by) : static_cast<int64_t>(by);
+      const uint64_t eat = ttl ? util::get_current_ts() + ttl : 0;
+
+      cache::set_return_t ret;
+      const auto result = cache::incr(
+          key, delta, eat,
+          [&]() { return load_cache(srv.db_conn, key, srv.id); }, ret);
+
+      if (result != cache::incr_done) {
+        set_content_type_json(hres);
+        hres.set_status(http_status_t.BAD_REQUEST_400);
+        hres.set_data(json_response::error(
+            69, result == cache::incr_not_integer ? "Value is not an integer"
+                                                  : "Value would overflow"));
+        return;
       }
 
+      srv.invalidate_l1(key);
+      db::flush_counter(key, COUNTER_FLUSH_MS);
+
+      // the row goes when the counter expires, like a set with a ttl
+      if (eat != 0)
+        db::delete_cache(key, eat);
+
       set_content_type_json(hres);
-      hres.set_data(
+      hres.headers.emplace_back(header_key_t.x_cache_version,
+                                std::to_string(ret.first.version));
 #ifndef SS_COMP
-          json_response::success(cached.to_json())
+      hres.set_data(json_response::success(ret.first));
 #else
-          cached.value
+      hres.set_body(ret.first.value);
 #endif // SS_COMP
-      );
-      return 0;
+    }
+
+    // lease of a get-or-set miss: the first caller gets one to set the key
+    // with, the ones after are told when to retry. false when the key got
+    // a value since the miss and nothing was answered
+    static inline bool respond_lease(http_response_t &hres,
+                                     const std::string &key) {
+      cache::lease_t lease;
+      const auto result = cache::acquire_lease(key, LEASE_TTL_MS, lease);
+
+      if (result == cache::lease_cached)
+        return false;
+
+      set_content_type_json(hres);
+
+      if (result == cache::lease_granted) {
+        hres.set_status(http_status_t.NOT_FOUND_404);
+        hres.headers.emplace_back(header_key_t.x_cache_lease,
+                                  std::to_string(lease.token));
+        hres.set_data(json_response::create_payload(
+            false, 69,
+            {{"message", "Key not found"},
+             {"lease", lease.token},
+             {"expires_at", lease.expires_at}}));
+        return true;
+      }
+
+      const uint64_t now = util::get_current_ts();
+      const uint64_t wait = lease.expires_at > now ? lease.expires_at - now : 0;
+
+      hres.set_status(http_status_t.SERVICE_UNAVAILABLE_503);
+      hres.headers.emplace_back(header_key_t.retry_after,
+                                std::to_string((wait + 999) / 1000));
+      hres.set_data(json_response::create_payload(
+          false, 69,
+          {{"message", "Key is being set"}, {"retry_after", wait}}));
+      return true;
     }
 
     static inline int
-    post_cache(uws_response_t *res, header_v_t &cors_headers,
-               endpoint_bench_t &bench,
+    post_cache(server_t &srv, uws_response_t *res, header_v_t &cors_headers,
+               endpoint_bench_t &bench, codec::stats_t &codec_stats,
                post_cache_custom_handler_fn custom_handler = nullptr) {
       bench.cancel();
 
-      auto handle_body = [res, cors_headers, custom_handler,
-                          bench](const std::string &body) {
+      auto handle_body = [&srv, res, cors_headers, custom_handler, bench,
+                          &codec_stats](const std::string &body) {
         endpoint_bench_t newbench{bench};
         newbench.cancel(false);
 
+        codec::scope_t codec_scope(codec_stats);
+
         http_response_t hres(res, cors_headers);
 
         nlohmann::json body_json = parse_json_body(body, hres);
@@ -863,9 +1784,16 @@ public:
           return;
 
         cache_data_t data;
+        std::vector<std::string> tags;
+        cache::set_condition_t cond;
+        bool lease = false;
 
         try {
-          data = parse_to_cache_data(body_json);
+          // only get-or-set hands out leases
+          lease = custom_handler && parse_lease(body_json);
+          data = parse_to_cache_data(body_json, 0, !lease);
+          tags = parse_tags(body_json);
+          cond = parse_condition(body_json);
 
           // log::io() << DEBUG_WHERE << "data.first(" << data.first
           //           << ") data.second(" << data.second.to_json_str(2) <<
@@ -887,25 +1815,63 @@ public:
           return;
         }
 
-        if (custom_handler && custom_handler(hres, data))
+        if (custom_handler && custom_handler(hres, data, lease))
           return;
 
         // - Sets cache in mem
         // - Schedules query to set cache in db
         // - Mark skip all previous query with the same key
-        cache::set(data.first, data.second);
-        db::set_cache(data.first, data.second);
+        // the response still sends what the client gave
+        hot_keys::record(hot_keys::write, data.first);
+
+        cache::data_t stored = data.second;
+        stored.compress();
+
+        cache::set_return_t ret;
+
+        if (cond.nx || cond.xx || cond.if_version || cond.lease) {
+          cache::data_t current;
+
+          const auto result = cache::set_if(
+              data.first, stored, cond,
+              [&]() { return load_cache(srv.db_conn, data.first, srv.id); },
+              ret, current);
+
+          if (result != cache::set_done) {
+            set_content_type_json(hres);
+            hres.set_status(http_status_t.PRECONDITION_FAILED_412);
+
+            if (!current.empty())
+              hres.headers.emplace_back(header_key_t.x_cache_version,
+                                        std::to_string(current.version));
+
+            hres.set_data(json_response::error(
+                69, result == cache::set_no_lease ? "Invalid lease"
+                    : current.empty()             ? "Key not found"
+                    : cond.nx                     ? "Key exists"
+                                                  : "Version mismatch"));
+            return;
+          }
+        } else {
+          ret = cache::set(data.first, stored);
+        }
+
+        // the version the write got, for the next conditional one
+        stored.version = data.second.version = ret.first.version;
+
+        srv.invalidate_l1(data.first);
+        db::set_cache(data.first, stored, tags);
 
         set_content_type_json(hres);
         // POST should response with 201 created
         hres.set_status(http_status_t.CREATED_201);
-        hres.set_data(
+        hres.headers.emplace_back(header_key_t.x_cache_version,
+                                  std::to_string(stored.version));
 #ifndef SS_COMP
-            json_response::success(data.second.to_json())
+        hres.set_data(json_response::success(data.second));
 #else
-            data.second.value
+        hres.set_body(data.second.value);
 #endif // SS_COMP
-        );
       };
 
       res_handle_body(res, std::move(handle_body));
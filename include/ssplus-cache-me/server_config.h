@@ -1,6 +1,8 @@
 #ifndef SERVER_CONFIG_H
 #define SERVER_CONFIG_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -15,7 +17,10 @@ struct server_config_t {
 
   std::string db_path;
 
-  server_config_t() : port(3000), cors_max_age(0) {}
+  // per server thread near cache entries, 0 disables it
+  size_t l1_entries;
+
+  server_config_t() : port(3000), cors_max_age(0), l1_entries(0) {}
 
   // bool with_ssl() { return !certfile.empty() && !pemfile.empty(); }
   bool with_ssl() { return false; }
@@ -0,0 +1,79 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Size class slab allocator for cache keys and values.
+ *
+ * Memory is mapped in 2MB arenas, cut into 64KB spans and each span only
+ * ever holds objects of one size class, so millions of small keys and
+ * values pack tightly instead of fragmenting the malloc heap. Freed
+ * objects go back to their class and are never returned to the OS.
+ *
+ * Each thread keeps a small magazine of free objects per class, the
+ * shared class lists are only locked to refill or drain a magazine.
+ *
+ * Requests above max_size fall through to malloc.
+ */
+namespace ssplus_cache_me::slab {
+
+inline constexpr size_t max_size = 16384;
+
+// back arenas with 2MB huge pages, must be called before the first
+// allocation to have any effect
+void set_huge_pages(bool enabled) noexcept;
+bool huge_pages() noexcept;
+
+// throws std::bad_alloc
+void *allocate(size_t n);
+// n must be the size p was allocated with
+void deallocate(void *p, size_t n) noexcept;
+
+// bytes actually taken by an allocation of n
+size_t usable_size(size_t n) noexcept;
+
+struct class_stats_t {
+  size_t object_size;
+  // bytes of spans owned by this class
+  size_t reserved_bytes;
+  // objects in use, objects cached in thread magazines count as in use
+  size_t used_objects;
+};
+
+std::vector<class_stats_t> get_class_stats();
+
+// bytes mapped for arenas
+size_t get_reserved_bytes() noexcept;
+
+// requests above max_size currently served by malloc
+size_t get_large_bytes() noexcept;
+
+template <typename T> struct allocator_t {
+  using value_type = T;
+
+  allocator_t() noexcept = default;
+
+  template <typename U> allocator_t(const allocator_t<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(slab::allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) noexcept {
+    slab::deallocate(p, n * sizeof(T));
+  }
+
+  template <typename U> bool operator==(const allocator_t<U> &) const noexcept {
+    return true;
+  }
+
+  template <typename U> bool operator!=(const allocator_t<U> &) const noexcept {
+    return false;
+  }
+};
+
+} // namespace ssplus_cache_me::slab
+
+#endif // SLAB_H
@@ -0,0 +1,49 @@
+#ifndef TAG_INDEX_H
+#define TAG_INDEX_H
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace ssplus_cache_me::cache {
+
+/**
+ * Tags of keys both ways: the keys of a tag to invalidate them together,
+ * and the tags of a key to drop it from them when it's set again or
+ * deleted.
+ *
+ * Nothing here is thread safe.
+ */
+class tag_index_t {
+  std::unordered_map<std::string, std::unordered_set<std::string>> keys_of;
+  std::unordered_map<std::string, std::vector<std::string>> tags_of;
+
+  size_t pairs = 0;
+  // estimated, see memory_usage()
+  size_t bytes = 0;
+
+public:
+  // key is tagged with tags only, none drops it
+  void set(const std::string &key, const std::vector<std::string> &tags);
+
+  // tag key without dropping its other tags, for loading
+  void add(const std::string &key, const std::string &tag);
+
+  void erase(const std::string &key);
+
+  bool has(const std::string &key) const;
+
+  std::vector<std::string> keys(const std::string &tag) const;
+
+  // distinct tags, and tag key pairs
+  size_t tag_count() const noexcept;
+  size_t size() const noexcept;
+
+  size_t memory_usage() const noexcept;
+};
+
+} // namespace ssplus_cache_me::cache
+
+#endif // TAG_INDEX_H
@@ -0,0 +1,64 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ssplus_cache_me::cache {
+
+/**
+ * Hierarchical timing wheel keyed by absolute millisecond timestamps.
+ *
+ * levels wheels of level_size slots each, a slot on level n spans
+ * level_size^n ticks. Timers are placed on the lowest level their
+ * distance fits in and cascade one level down every time the wheel
+ * below wraps, so adding and firing a timer is O(1) no matter how many
+ * are pending.
+ *
+ * Timers only carry the key hash and are never removed before they fire.
+ * Whoever consumes them is expected to find the entry they were set for
+ * and check it's still relevant, eg. the key didn't get a new expires_at
+ * meanwhile.
+ *
+ * Not thread safe, each cache shard owns one under its lock.
+ */
+class timer_wheel_t {
+public:
+  struct timer_t {
+    size_t hash;
+    uint64_t expires_at;
+  };
+
+  static constexpr uint64_t tick_ms = 10;
+  static constexpr int level_bits = 6;
+  static constexpr size_t level_size = size_t{1} << level_bits;
+  // 64^6 ticks of 10ms is well over 20 years, anything further gets
+  // parked on the last slot and placed again once it fires
+  static constexpr int levels = 6;
+
+private:
+  std::vector<timer_t> slots[levels][level_size];
+
+  // next tick to process
+  uint64_t current;
+  size_t count;
+
+  void place(timer_t &&t);
+  void cascade(int level);
+
+public:
+  explicit timer_wheel_t(uint64_t now_ms);
+
+  void add(size_t hash, uint64_t expires_at);
+
+  // move every timer due at or before now_ms into due
+  void advance(uint64_t now_ms, std::vector<timer_t> &due);
+
+  size_t size() const noexcept;
+  bool empty() const noexcept;
+};
+
+} // namespace ssplus_cache_me::cache
+
+#endif // TIMER_WHEEL_H
@@ -3,15 +3,40 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 
 namespace ssplus_cache_me::util {
 
-uint64_t get_current_ts();
+// how often the clock started by start_clock() ticks
+inline constexpr uint64_t clock_tick_ms = 1;
+
+// milliseconds since epoch. While start_clock() runs it's a load of the
+// last tick, up to about clock_tick_ms behind the system clock. Asks the
+// system clock otherwise
+uint64_t get_current_ts() noexcept;
+
+// start the thread ticking get_current_ts(), no-op when already running
+void start_clock();
+
+// stop it, get_current_ts() asks the system clock again
+void stop_clock() noexcept;
 
 uint64_t ms_to_ns(uint64_t ms) noexcept;
 
+// murmur3 fmix64. The raw key hash is also used for shard and slot
+// picking, structures indexing with it again spread its bits first
+inline uint64_t spread_hash(uint64_t x) noexcept {
+  x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdull;
+  x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ull;
+  return x ^ (x >> 33);
+}
+
 std::string trim(const std::string &s);
 
+// append s to out as the content of a json string, escaped the same way
+// nlohmann does it (without ensure_ascii)
+void json_escape(std::string &out, std::string_view s);
+
 } // namespace ssplus_cache_me::util
 
 #endif // UTIL_H
@@ -1,44 +1,224 @@
 #include "ssplus-cache-me/cache.h"
 #include "ssplus-cache-me/debug.h"
+#include "ssplus-cache-me/epoch.h"
+#include "ssplus-cache-me/flat_map.h"
+#include "ssplus-cache-me/frequency_sketch.h"
 #include "ssplus-cache-me/log.h"
+#include "ssplus-cache-me/slab.h"
+#include "ssplus-cache-me/timer_wheel.h"
+#include "ssplus-cache-me/util.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
 #include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 
 DECLARE_DEBUG_INFO_DEFAULT();
 
 namespace ssplus_cache_me::cache {
 
+// value_t /////////////////////////////////////////////////////////////////////
+
+// header of a buffer in slab memory. A standalone value only holds the
+// value bytes, a cache entry packs its key in front of them and its version
+// behind, and keeps its expiry and state in the header too, see entry_t
+struct value_t::block_t {
+  static constexpr uint8_t flag_dirty = 1;
+  // expires_at didn't fit in expires, the full 8 bytes follow the value
+  static constexpr uint8_t flag_wide_expiry = 2;
+  // packed by entry_t. Readers outside the shard lock may still look at
+  // it after its last reference is gone, so it's freed through the epoch
+  static constexpr uint8_t flag_entry = 4;
+  // value is gzip compressed
+  static constexpr uint8_t flag_gzip = 8;
+
+  std::atomic<uint32_t> refs;
+  uint32_t key_size;
+  uint32_t value_size;
+
+  // expires_at - expiry_base + 1, 0 when there's none
+  uint32_t expires;
+
+  // CLOCK reference bit, set by readers not holding the exclusive lock
+  std::atomic<uint8_t> referenced;
+  // only flag_dirty ever changes
+  std::atomic<uint8_t> flags;
+
+  // data_t::delta of an entry, fits the padding
+  uint16_t delta;
+
+  block_t(uint32_t _key_size, uint32_t _value_size, uint8_t _flags)
+      : refs(1), key_size(_key_size), value_size(_value_size), expires(0),
+        referenced(1), flags(_flags), delta(0) {}
+
+  char *bytes() noexcept { return reinterpret_cast<char *>(this + 1); }
+
+  const char *bytes() const noexcept {
+    return reinterpret_cast<const char *>(this + 1);
+  }
+
+  size_t alloc_size() const noexcept {
+    const uint8_t f = flags.load(std::memory_order_relaxed);
+
+    return sizeof(block_t) + key_size + value_size +
+           (f & flag_wide_expiry ? sizeof(uint64_t) : 0) +
+           (f & flag_entry ? sizeof(uint64_t) : 0);
+  }
+
+  std::string_view key() const noexcept {
+    return std::string_view(bytes(), key_size);
+  }
+};
+
+static uint32_t checked_size(size_t n) {
+  if (n > UINT32_MAX)
+    throw std::length_error("cache key or value over 4GB");
+
+  return static_cast<uint32_t>(n);
+}
+
+value_t::value_t(std::string &&s) : value_t(s.data(), s.size()) {}
+
+value_t::value_t(const char *data, size_t len) : buf(nullptr) {
+  if (len == 0)
+    return;
+
+  const uint32_t size = checked_size(len);
+
+  buf = new (slab::allocate(sizeof(block_t) + len)) block_t(0, size, 0);
+  std::memcpy(buf->bytes(), data, len);
+}
+
+value_t::value_t(const value_t &o) noexcept : buf(o.buf) {
+  if (buf)
+    buf->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+value_t::value_t(value_t &&o) noexcept : buf(o.buf) { o.buf = nullptr; }
+
+value_t &value_t::operator=(const value_t &o) noexcept {
+  if (o.buf)
+    o.buf->refs.fetch_add(1, std::memory_order_relaxed);
+
+  release();
+  buf = o.buf;
+  return *this;
+}
+
+value_t &value_t::operator=(value_t &&o) noexcept {
+  if (this != &o) {
+    release();
+    buf = o.buf;
+    o.buf = nullptr;
+  }
+
+  return *this;
+}
+
+value_t::~value_t() { release(); }
+
+static void free_block(void *p, size_t n) noexcept {
+  static_cast<value_t::block_t *>(p)->~block_t();
+  slab::deallocate(p, n);
+}
+
+void value_t::release() noexcept {
+  if (!buf || buf->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+
+  const size_t n = buf->alloc_size();
+
+  if (buf->flags.load(std::memory_order_relaxed) & block_t::flag_entry)
+    epoch::retire(buf, n, free_block);
+  else
+    free_block(buf, n);
+
+  buf = nullptr;
+}
+
+const char *value_t::data() const noexcept {
+  return buf ? buf->bytes() + buf->key_size : "";
+}
+
+size_t value_t::size() const noexcept { return buf ? buf->value_size : 0; }
+
+bool value_t::empty() const noexcept { return size() == 0; }
+
+std::string_view value_t::view() const noexcept {
+  return std::string_view(data(), size());
+}
+
+std::string value_t::str() const { return std::string(view()); }
+
+bool value_t::shares(const value_t &o) const noexcept { return buf == o.buf; }
+
+size_t value_t::memory_usage() const noexcept {
+  return buf ? slab::usable_size(buf->alloc_size()) : 0;
+}
+
 // data_t //////////////////////////////////////////////////////////////////////
 
-data_t::data_t() : expires_at(0) {}
+// values of at least this many bytes get compressed, 0 never. Set by init()
+static size_t compress_min_size = 0;
+
+data_t::data_t()
+    : expires_at(0), codec(codec::identity), version(0), delta(0) {}
 
 bool data_t::empty() const { return value.empty() && expires_at == 0; }
 
-bool data_t::expired() const {
-  return expires_at <=
-         static_cast<uint64_t>(
-             std::chrono::duration_cast<std::chrono::milliseconds>(
-                 std::chrono::system_clock::now().time_since_epoch())
-                 .count());
-}
+bool data_t::expired() const { return expires_at <= util::get_current_ts(); }
 
 data_t &data_t::clear() {
-  value.clear();
+  value = {};
   expires_at = 0;
   return *this;
 }
 
-data_t &data_t::mark_cached() {
-  if (expires_at == 0)
-    expires_at = 1;
+uint64_t data_t::get_expires_at() const noexcept { return expires_at; }
 
-  return *this;
+bool data_t::compressed() const noexcept { return codec != codec::identity; }
+
+value_t data_t::plain() const {
+  if (!compressed())
+    return value;
+
+  std::string out;
+  if (!codec::gzip_decompress(value.view(), out)) {
+    log::io() << DEBUG_WHERE << "Corrupt compressed value of "
+              << value.size() << " bytes\n";
+    return {};
+  }
+
+  return value_t(std::move(out));
 }
 
-bool data_t::cached() const { return expires_at != 0 || !value.empty(); }
+data_t &data_t::compress() {
+  if (compressed() || compress_min_size == 0 ||
+      value.size() < compress_min_size)
+    return *this;
+
+  std::string out = codec::gzip_compress(value.view());
 
-uint64_t data_t::get_expires_at() const noexcept {
-  return expires_at == 1 ? 0 : expires_at;
+  // incompressible, not worth the decompression later
+  if (out.empty() || out.size() >= value.size())
+    return *this;
+
+  value = value_t(std::move(out));
+  codec = codec::gzip;
+  return *this;
 }
 
 int data_t::from_json_str(const std::string &s) noexcept {
@@ -64,8 +244,9 @@ int data_t::from_json(const nlohmann::json &d) {
   if (iv == ie || iex == ie || !iv->is_string() || !iex->is_number_unsigned())
     return 2;
 
-  value = iv->get<std::string>();
+  value = value_t(iv->get<std::string>());
   expires_at = iex->get<uint64_t>();
+  codec = codec::identity;
 
   return 0;
 }
@@ -73,92 +254,1615 @@ int data_t::from_json(const nlohmann::json &d) {
 nlohmann::json data_t::to_json() const {
   return {{
               "value",
-              value,
+              plain().view(),
           },
-          {"expires_at", get_expires_at()}};
+          {"expires_at", get_expires_at()},
+          {"version", version}};
 }
 
 std::string data_t::to_json_str(int indent) const {
   return to_json().dump(indent);
 }
 
+void data_t::dump_json(std::string &out) const {
+  // keys in the same order nlohmann dumps them
+  out += "{\"expires_at\":";
+  out += std::to_string(get_expires_at());
+  out += ",\"value\":\"";
+  util::json_escape(out, plain().view());
+  out += "\",\"version\":";
+  out += std::to_string(version);
+  out += '}';
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// entry_t /////////////////////////////////////////////////////////////////////
+
+// base of the 32 bit expiry offsets in entry headers, set by init()
+static uint64_t expiry_base = 0;
+
+// last next_version(), set by init()
+static std::atomic<uint64_t> last_version = 0;
+
+// versions handed out per ms of uptime before they'd overtake the ones of
+// the next boot, keeps them under 2^53 for another couple of centuries
+static constexpr int version_ts_shift = 10;
+
+// a cache entry is a single pointer to a block packing its header, key and
+// value back to back. Compared to a slot holding a std::string key next to
+// a data_t this saves ~50 bytes per entry plus a separate key allocation.
+// expires_at is stored as a 32 bit offset from expiry_base, about 49 days
+// of range, anything out of range takes 8 more bytes after the value. The
+// version always takes the last 8
+class entry_t {
+  using block_t = value_t::block_t;
+
+  // owns one reference to the block, readers get a value_t sharing it
+  value_t handle;
+
+  block_t *block() const noexcept { return handle.buf; }
+
+  explicit entry_t(block_t *b) noexcept { handle.buf = b; }
+
+public:
+  entry_t(std::string_view key, const data_t &data, bool dirty,
+          uint64_t version) {
+    const uint32_t key_size = checked_size(key.size());
+    const uint32_t value_size = checked_size(data.value.size());
+    const uint64_t eat = data.expires_at;
+
+    uint8_t flags = block_t::flag_entry | (dirty ? block_t::flag_dirty : 0);
+
+    if (data.codec == codec::gzip)
+      flags |= block_t::flag_gzip;
+    uint32_t expires = 0;
+
+    if (eat >= expiry_base && eat - expiry_base < UINT32_MAX)
+      expires = static_cast<uint32_t>(eat - expiry_base + 1);
+    else if (eat != 0)
+      flags |= block_t::flag_wide_expiry;
+
+    const size_t size = sizeof(block_t) + key_size + value_size +
+                        (flags & block_t::flag_wide_expiry ? sizeof(eat) : 0) +
+                        sizeof(version);
+
+    auto *b = new (slab::allocate(size)) block_t(key_size, value_size, flags);
+    b->expires = expires;
+    b->delta = data.delta;
+
+    char *p = b->bytes();
+    std::memcpy(p, key.data(), key_size);
+    std::memcpy(p + key_size, data.value.data(), value_size);
+
+    p += key_size + value_size;
+    if (flags & block_t::flag_wide_expiry) {
+      std::memcpy(p, &eat, sizeof(eat));
+      p += sizeof(eat);
+    }
+
+    std::memcpy(p, &version, sizeof(version));
+
+    handle.buf = b;
+  }
+
+  // the block of an entry a reader outside the shard lock is looking at,
+  // the slot can change under it. Only safe to read inside an epoch guard,
+  // and nullptr once the entry got moved out
+  block_t *peek() const noexcept {
+    return __atomic_load_n(&handle.buf, __ATOMIC_RELAXED);
+  }
+
+  // shares the entry packed in b, for readers that found b through peek().
+  // Fails once the last reference is gone and b only waits to be reclaimed
+  static std::optional<entry_t> try_share(block_t *b) noexcept {
+    uint32_t refs = b->refs.load(std::memory_order_relaxed);
+
+    do {
+      if (refs == 0)
+        return std::nullopt;
+    } while (!b->refs.compare_exchange_weak(refs, refs + 1,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed));
+
+    return entry_t(b);
+  }
+
+  std::string_view key() const noexcept { return block()->key(); }
+
+  uint64_t expires_at() const noexcept {
+    const block_t *b = block();
+    const uint8_t flags = b->flags.load(std::memory_order_relaxed);
+
+    if (flags & block_t::flag_wide_expiry) {
+      uint64_t ret;
+      std::memcpy(&ret, b->bytes() + b->key_size + b->value_size,
+                  sizeof(ret));
+      return ret;
+    }
+
+    return b->expires ? expiry_base + b->expires - 1 : 0;
+  }
+
+  uint64_t version() const noexcept {
+    const block_t *b = block();
+    const char *p = b->bytes() + b->key_size + b->value_size;
+
+    if (b->flags.load(std::memory_order_relaxed) & block_t::flag_wide_expiry)
+      p += sizeof(uint64_t);
+
+    uint64_t ret;
+    std::memcpy(&ret, p, sizeof(ret));
+    return ret;
+  }
+
+  codec::codec_t codec() const noexcept {
+    return block()->flags.load(std::memory_order_relaxed) & block_t::flag_gzip
+               ? codec::gzip
+               : codec::identity;
+  }
+
+  data_t data() const & {
+    data_t ret;
+    if (block()->value_size)
+      ret.value = handle;
+    ret.expires_at = expires_at();
+    ret.codec = codec();
+    ret.version = version();
+    ret.delta = block()->delta;
+    return ret;
+  }
+
+  // hands the entry's own reference over to the data
+  data_t data() && {
+    data_t ret;
+    ret.expires_at = expires_at();
+    ret.codec = codec();
+    ret.version = version();
+    ret.delta = block()->delta;
+    if (block()->value_size)
+      ret.value = std::move(handle);
+    return ret;
+  }
+
+  const value_t &value() const noexcept { return handle; }
+
+  // value not yet written to db, evicting it would lose the write
+  bool dirty() const noexcept {
+    return block()->flags.load(std::memory_order_relaxed) &
+           block_t::flag_dirty;
+  }
+
+  void clear_dirty() noexcept {
+    block()->flags.fetch_and(~block_t::flag_dirty, std::memory_order_relaxed);
+  }
+
+  // CLOCK reference bit, safe without the exclusive lock
+  void touch() const noexcept {
+    auto &r = block()->referenced;
+    if (!r.load(std::memory_order_relaxed))
+      r.store(1, std::memory_order_relaxed);
+  }
+
+  bool clear_referenced() noexcept {
+    return block()->referenced.exchange(0, std::memory_order_relaxed);
+  }
+
+  // estimated heap bytes owned by the entry
+  size_t heap_bytes() const noexcept { return handle.memory_usage(); }
+
+  size_t key_bytes() const noexcept { return block()->key_size; }
+  size_t value_bytes() const noexcept { return block()->value_size; }
+};
+
+// lookups take plain strings, the key itself lives in the entry block
+struct key_hash_t {
+  size_t operator()(std::string_view s) const noexcept {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+struct key_equal_t {
+  bool operator()(std::string_view a, std::string_view b) const noexcept {
+    return a == b;
+  }
+};
+
+struct key_of_t {
+  std::string_view operator()(const entry_t &e) const noexcept {
+    return e.key();
+  }
+};
+
+// lock free readers may still probe a table that just got replaced
+struct table_free_t {
+  void operator()(void *p, size_t n) const noexcept {
+    epoch::retire(p, n, [](void *q, size_t) { std::free(q); });
+  }
+};
+
+using cache_map_t = flat_map::flat_set_t<entry_t, key_of_t, key_hash_t,
+                                         key_equal_t, table_free_t>;
+
 ////////////////////////////////////////////////////////////////////////////////
 
-static cache_map_t mcache;
-static std::shared_mutex mcache_m;
+// a CLOCK managed region of a shard
+struct segment_t {
+  static constexpr size_t npos = static_cast<size_t>(-1);
 
-static vector_data_t mallcache;
+  cache_map_t map;
+
+  // sum of entry_t::heap_bytes(), the table itself is map.memory_usage()
+  size_t heap_bytes = 0;
+  // sums of the key and value sizes packed in those
+  size_t key_bytes = 0;
+  size_t value_bytes = 0;
+
+  // entries the writer didn't persist yet, clock_victim() can't pick them
+  size_t dirty = 0;
+
+  size_t clock_hand = 0;
+
+  size_t memory_usage() const noexcept {
+    return map.memory_usage() + heap_bytes;
+  }
+
+  void add(const entry_t &e) noexcept {
+    heap_bytes += e.heap_bytes();
+    key_bytes += e.key_bytes();
+    value_bytes += e.value_bytes();
+    dirty += e.dirty();
+  }
+
+  void sub(const entry_t &e) noexcept {
+    heap_bytes -= e.heap_bytes();
+    key_bytes -= e.key_bytes();
+    value_bytes -= e.value_bytes();
+    dirty -= e.dirty();
+  }
+
+  void clear_dirty(entry_t &e) noexcept {
+    if (e.dirty()) {
+      e.clear_dirty();
+      dirty--;
+    }
+  }
+
+  void insert(entry_t &&e, size_t hash) {
+    add(e);
+
+    auto [i, found] = map.find_or_prepare_insert(e.key(), hash);
+    if (found) {
+      sub(map.at(i));
+      map.at(i) = std::move(e);
+    } else {
+      map.emplace_at(i, hash, std::move(e));
+    }
+  }
+
+  void replace(entry_t &old, entry_t &&e) noexcept {
+    sub(old);
+    add(e);
+    old = std::move(e);
+  }
+
+  entry_t take_at(size_t i) noexcept {
+    entry_t ret = std::move(map.at(i));
+    sub(ret);
+    map.erase_at(i);
+    return ret;
+  }
+
+  void erase_at(size_t i) noexcept {
+    sub(map.at(i));
+    map.erase_at(i);
+  }
+
+  size_t erase(std::string_view key, size_t hash) {
+    auto *e = map.find(key, hash);
+    if (!e)
+      return 0;
+
+    sub(*e);
+    return map.erase(key, hash);
+  }
+
+  // sweep the table from the hand and return the first entry that hasn't
+  // been referenced since the last pass, clearing reference bits on the
+  // way. Dirty entries are skipped, they only exist in memory until the
+  // writer persists them. npos when nothing is evictable
+  size_t clock_victim() noexcept {
+    // a writer lagging behind fills the window with dirty entries, don't
+    // sweep it on every set then
+    if (dirty == map.size())
+      return npos;
+
+    const size_t capacity = map.capacity();
+    // two full sweeps clears every reference bit, anything after that is
+    // dirty
+    size_t budget = capacity * 2;
+
+    while (!map.empty() && budget-- > 0) {
+      size_t i = clock_hand & (capacity - 1);
+      clock_hand = i + 1;
+
+      if (!map.full_at(i))
+        continue;
+
+      auto &e = map.at(i);
+      if (e.dirty())
+        continue;
+
+      if (e.clear_referenced())
+        continue;
+
+      return i;
+    }
+
+    return npos;
+  }
+};
+
+// version of a key a caller was told to refresh, see refresh_early()
+struct refresh_claim_t {
+  uint64_t version;
+  uint64_t expires_at;
+};
+
+// a db load in progress, see get_or_load()
+struct flight_t {
+  std::mutex m;
+  std::condition_variable cv;
+  bool done = false;
+  data_t data;
+};
+
+// each shard sits on its own cache line so writers on different shards
+// don't bounce each other's lock
+struct alignas(64) shard_t {
+  std::shared_mutex m;
+
+  // odd while a writer changes the maps, see get()
+  std::atomic<uint64_t> seq = 0;
+
+  segment_t main;
+
+  // W-TinyLFU admission window, new keys land here first and only move
+  // to main when the sketch says they're worth it. Only used when
+  // max_memory is set
+  segment_t window;
+
+  // access frequency of keys in and out of the cache
+  frequency_sketch_t sketch;
+
+  // expires_at of every entry that has one, created on the first of them
+  std::unique_ptr<timer_wheel_t> wheel;
+  // lets the expiry thread skip shards without ever taking their lock
+  std::atomic<bool> has_timers = false;
+
+  // loads of missed keys in progress, misses on the same key wait on them
+  std::mutex flights_m;
+  std::unordered_map<std::string, std::shared_ptr<flight_t>> flights;
+
+  // leases of missing keys, see acquire_lease(). Expired ones are swept
+  // once there are lease_sweep_at of them
+  std::unordered_map<std::string, lease_t> leases;
+  size_t lease_sweep_at = 0;
+
+  // early refreshes handed out, by key so the same version loaded again
+  // from db doesn't get a second one. Swept like leases once there are
+  // refresh_sweep_at of them
+  std::unordered_map<std::string, refresh_claim_t> refreshes;
+  size_t refresh_sweep_at = 0;
+
+  // keys deleted from db, bumped by mark_deleted(). A row loaded before it
+  // moved may be gone and isn't cached
+  std::atomic<uint64_t> deletes = 0;
+
+  uint64_t evictions = 0;
+  // window victims that lost against the main victim
+  uint64_t rejections = 0;
+  uint64_t expirations = 0;
+
+  size_t memory_usage() const noexcept {
+    return main.memory_usage() + window.memory_usage();
+  }
+};
+
+// marks the shard as changing for readers not taking its lock, they retry
+// any lookup that overlapped it. Needs the exclusive lock, doesn't nest
+struct write_section_t {
+  shard_t &shard;
+
+  explicit write_section_t(shard_t &_shard) noexcept : shard(_shard) {
+    shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  ~write_section_t() {
+    shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+  }
+};
+
+static std::unique_ptr<shard_t[]> shards;
+static size_t shard_count = 0;
+static int shard_bits = 0;
+// per shard share of max_memory, 0 means unbounded
+static size_t shard_max_memory = 0;
+// window_max_memory + main_max_memory == shard_max_memory
+static size_t window_max_memory = 0;
+static size_t main_max_memory = 0;
+
+// share of shard_max_memory given to the admission window
+static constexpr size_t window_percent = 1;
+
+// lookups racing a writer before get() falls back to the shard lock
+static constexpr int optimistic_reads = 4;
+
+static std::thread expiry_thread;
+static std::mutex expiry_m;
+static std::condition_variable expiry_cv;
+static bool expiry_running = false;
+
+static all_data_t mallcache;
+// estimated, sum of view_row_bytes() of every row
+static size_t mallcache_bytes = 0;
 static bool mallcache_loaded = false;
 static std::shared_mutex mallcache_m;
+static std::condition_variable_any mallcache_cv;
 
-static void reset_mallcache_unlocked() {
-  mallcache.clear();
-  mallcache_loaded = false;
-}
+// persistent_map_t leaf, its shared_ptr control block and the trie slot
+// pointing at it
+static constexpr size_t view_row_overhead = 96;
 
-static void reset_mallcache() {
-  std::lock_guard lk(mallcache_m);
-  return reset_mallcache_unlocked();
+static size_t view_row_bytes(const std::string &key, const data_t &d) noexcept {
+  return view_row_overhead + key.size() + d.value.memory_usage();
 }
 
-[[nodiscard]] std::lock_guard<std::shared_mutex> acquire_lock() {
-  return std::lock_guard(mcache_m);
-}
+// keys in db, see known_absent()
+static std::atomic<key_filter_t *> key_filter = nullptr;
+
+// keys in db in order, see list_keys()
+static std::unique_ptr<key_index_t> key_index;
+static std::shared_mutex key_index_m;
+
+// tags of keys in db, see tagged_keys()
+static std::unique_ptr<tag_index_t> tag_index;
+static std::shared_mutex tag_index_m;
+
+// drop every entry the shard wheel says is due. The wheel doesn't know
+// about updates and deletes so each timer is checked against the entry
+// it was set for
+static void expire_unlocked(shard_t &shard, uint64_t now,
+                            std::vector<timer_wheel_t::timer_t> &due) {
+  write_section_t ws(shard);
+
+  due.clear();
+  shard.wheel->advance(now, due);
 
-[[nodiscard]] std::shared_lock<std::shared_mutex> acquire_shared_lock() {
-  return std::shared_lock(mcache_m);
+  for (auto &t : due) {
+    // timers only keep the key hash, anything on its probe sequence with
+    // the same hash and expires_at is the entry it was set for
+    auto match = [&t](const entry_t &e) {
+      return e.expires_at() == t.expires_at &&
+             cache_map_t::hash(e.key()) == t.hash;
+    };
+
+    segment_t *seg = &shard.main;
+    auto *e = seg->map.find_if(t.hash, match);
+
+    if (!e) {
+      seg = &shard.window;
+      e = seg->map.find_if(t.hash, match);
+    }
+
+    if (!e)
+      continue;
+
+    seg->erase(e->key(), t.hash);
+    shard.expirations++;
+  }
+
+  if (shard.wheel->empty())
+    shard.has_timers.store(false, std::memory_order_relaxed);
 }
 
-data_t get_unlocked(const std::string &key) {
-  auto i = mcache.find(key);
-  if (i == mcache.end())
-    return {};
+// expires memory entries on time, without waiting on the db writer to get
+// to their delete query
+static void expiry_routine() {
+  std::vector<timer_wheel_t::timer_t> due;
+
+  std::unique_lock lk(expiry_m);
+  while (expiry_running) {
+    expiry_cv.wait_for(lk, std::chrono::milliseconds(timer_wheel_t::tick_ms));
+    if (!expiry_running)
+      break;
 
-  return i->second;
+    lk.unlock();
+
+    const uint64_t now = util::get_current_ts();
+    for (size_t i = 0; i < shard_count; i++) {
+      auto &shard = shards[i];
+      if (!shard.has_timers.load(std::memory_order_relaxed))
+        continue;
+
+      std::lock_guard slk(shard.m);
+      expire_unlocked(shard, now, due);
+    }
+
+    // frees what got expired once no reader can still see it
+    epoch::quiescent();
+
+    lk.lock();
+  }
 }
 
-data_t get(const std::string &key) {
-  std::shared_lock lk(mcache_m);
-  return get_unlocked(key);
+int init(const cache_config_t &conf) noexcept {
+  if (shards) {
+    log::io() << DEBUG_WHERE << "Cache already initialized\n";
+    return 1;
+  }
+
+  size_t _shard_count = conf.shard_count;
+  if (_shard_count < 1)
+    _shard_count = 1;
+  else if (_shard_count > max_shard_count)
+    _shard_count = max_shard_count;
+
+  shard_bits = 0;
+  while ((size_t{1} << shard_bits) < _shard_count)
+    shard_bits++;
+
+  shard_count = size_t{1} << shard_bits;
+  shards = std::make_unique<shard_t[]>(shard_count);
+
+  expiry_base = util::get_current_ts();
+  observe_version(expiry_base << version_ts_shift);
+
+  shard_max_memory = conf.max_memory / shard_count;
+  if (conf.max_memory != 0 && shard_max_memory == 0)
+    shard_max_memory = 1;
+
+  window_max_memory = shard_max_memory * window_percent / 100;
+  main_max_memory = shard_max_memory - window_max_memory;
+
+  slab::set_huge_pages(conf.huge_pages);
+  compress_min_size = conf.compress_min_size;
+
+  expiry_running = true;
+  expiry_thread = std::thread(expiry_routine);
+
+  auto &os = log::io() << "Memory cache initialized with " << shard_count
+                       << " shard(s)";
+  if (conf.max_memory != 0)
+    os << ", max memory " << conf.max_memory << " bytes";
+  if (conf.huge_pages)
+    os << ", huge pages";
+  os << "\n";
+
+  return 0;
 }
 
-get_all_return_t get_all_unlocked() { return {mallcache, mallcache_loaded}; }
+void shutdown() noexcept {
+  {
+    std::lock_guard lk(expiry_m);
+    if (!expiry_running)
+      return;
 
-get_all_return_t get_all() {
-  std::shared_lock lk(mallcache_m);
-  return get_all_unlocked();
+    expiry_running = false;
+  }
+
+  expiry_cv.notify_all();
+  expiry_thread.join();
 }
 
-set_return_t set_unlocked(const std::string &key, const data_t &value) {
-  reset_mallcache();
-  return mcache.insert_or_assign(key, value);
+size_t get_shard_count() noexcept { return shard_count; }
+
+memory_stats_t get_memory_stats() {
+  memory_stats_t ret;
+
+  for (size_t i = 0; i < shard_count; i++) {
+    auto &shard = shards[i];
+
+    {
+      std::shared_lock lk(shard.m);
+
+      for (const segment_t *seg : {&shard.main, &shard.window}) {
+        ret.entries += seg->map.size();
+        ret.key_bytes += seg->key_bytes;
+        ret.value_bytes += seg->value_bytes;
+        ret.overhead +=
+            seg->memory_usage() - seg->key_bytes - seg->value_bytes;
+      }
+
+      ret.leases += shard.leases.size();
+    }
+
+    std::lock_guard lk(shard.flights_m);
+    ret.loads += shard.flights.size();
+  }
+
+  {
+    std::shared_lock lk(mallcache_m);
+    ret.view_loaded = mallcache_loaded;
+    ret.view_rows = mallcache.size();
+    ret.view_bytes = mallcache_bytes;
+  }
+
+  {
+    std::shared_lock lk(key_index_m);
+    if (key_index) {
+      ret.index_keys = key_index->size();
+      ret.index_bytes = key_index->memory_usage();
+    }
+  }
+
+  {
+    std::shared_lock lk(tag_index_m);
+    if (tag_index) {
+      ret.tags = tag_index->tag_count();
+      ret.tagged = tag_index->size();
+      ret.tags_bytes = tag_index->memory_usage();
+    }
+  }
+
+  epoch::read_guard_t guard;
+
+  if (const auto *f = key_filter.load(std::memory_order_acquire)) {
+    ret.filter_keys = f->size();
+    ret.filter_bytes = f->memory_usage();
+  }
+
+  return ret;
 }
 
-set_return_t set(const std::string &key, const data_t &value) {
-  std::lock_guard lk(mcache_m);
-  return set_unlocked(key, value);
+size_t memory_usage() noexcept {
+  size_t ret = 0;
+
+  for (size_t i = 0; i < shard_count; i++) {
+    std::shared_lock lk(shards[i].m);
+    ret += shards[i].memory_usage();
+  }
+
+  return ret;
 }
 
-get_all_return_t set_all_unlocked(const vector_data_t &values,
-                                  bool loaded_state) {
-  mallcache = values;
-  mallcache_loaded = loaded_state;
-  return {mallcache, mallcache_loaded};
+static shard_t &get_shard(size_t hash) {
+  if (shard_bits == 0)
+    return shards[0];
+
+  // fibonacci hashing, take the top bits so the shard index doesn't
+  // correlate with the h1/h2 bits used inside the shard map
+  return shards[(static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >>
+                (64 - shard_bits)];
 }
 
-get_all_return_t set_all(const vector_data_t &values, bool loaded_state) {
-  std::lock_guard lk(mallcache_m);
-  return set_all_unlocked(values, loaded_state);
+static shard_t &get_shard(std::string_view key) {
+  return get_shard(cache_map_t::hash(key));
 }
 
-size_t del_unlocked(const std::string &key) {
-  reset_mallcache();
-  return mcache.erase(key);
+// W-TinyLFU admission, the window victim at i only moves to main when
+// main has room for it or when it's been accessed more often than every
+// main victim that has to go to make that room. One-off keys (eg. a batch
+// job scanning every key) therefore can't push the hot set out of main
+static void admit_unlocked(shard_t &shard, size_t i) {
+  auto &window = shard.window;
+  auto &main = shard.main;
+
+  const size_t hash = cache_map_t::hash(window.map.at(i).key());
+  const size_t heap_bytes = window.map.at(i).heap_bytes();
+  const int freq = shard.sketch.frequency(hash);
+
+  // every victim is picked and compared before any goes, a rejected
+  // candidate doesn't cost main the victims colder than it
+  static thread_local std::vector<size_t> victims;
+  victims.clear();
+
+  size_t freed = 0;
+
+  while (main.memory_usage() - freed + heap_bytes > main_max_memory) {
+    size_t v = main.clock_victim();
+
+    // the hand came around to a victim already picked
+    if (v == segment_t::npos ||
+        std::find(victims.begin(), victims.end(), v) != victims.end() ||
+        shard.sketch.frequency(cache_map_t::hash(main.map.at(v).key())) >=
+            freq) {
+      window.erase_at(i);
+      shard.rejections++;
+      shard.evictions++;
+      return;
+    }
+
+    victims.push_back(v);
+    freed += main.map.at(v).heap_bytes();
+  }
+
+  for (size_t v : victims) {
+    main.erase_at(v);
+    shard.evictions++;
+  }
+
+  main.insert(window.take_at(i), hash);
 }
 
-size_t del(const std::string &key) {
-  std::lock_guard lk(mcache_m);
-  return del_unlocked(key);
+// evicted entries are still in db and will be loaded again on the next miss
+static void evict_unlocked(shard_t &shard) {
+  if (shard_max_memory == 0)
+    return;
+
+  while (shard.window.memory_usage() > window_max_memory) {
+    size_t i = shard.window.clock_victim();
+    if (i == segment_t::npos)
+      break;
+
+    admit_unlocked(shard, i);
+  }
+
+  // a burst of dirty writes can blow the window table up, give that back
+  // once they've moved on to main
+  if (shard.window.map.size() * 8 < shard.window.map.capacity())
+    shard.window.map.shrink_to_fit();
+
+  // main can still be over, eg. after an update grew a value or once dirty
+  // entries got persisted
+  while (shard.main.memory_usage() > main_max_memory) {
+    size_t i = shard.main.clock_victim();
+    if (i == segment_t::npos)
+      break;
+
+    shard.main.erase_at(i);
+    shard.evictions++;
+  }
+}
+
+static entry_t *find_unlocked(shard_t &shard, std::string_view key,
+                              size_t hash) {
+  if (auto *e = shard.main.map.find(key, hash))
+    return e;
+
+  if (shard_max_memory == 0)
+    return nullptr;
+
+  return shard.window.map.find(key, hash);
+}
+
+// lookup for readers not holding the shard lock. out is only safe to read
+// inside an epoch guard and only the block of key if shard.seq didn't move
+// meanwhile. false when a probe gave up on a table changing under it
+static bool find_concurrent(const shard_t &shard, std::string_view key,
+                            size_t hash, value_t::block_t *&out) {
+  out = nullptr;
+
+  auto match = [&](const entry_t &e) {
+    auto *b = e.peek();
+    if (!b || b->key() != key)
+      return false;
+
+    out = b;
+    return true;
+  };
+
+  if (!shard.main.map.probe_concurrent(hash, match))
+    return false;
+
+  if (out || shard_max_memory == 0)
+    return true;
+
+  return shard.window.map.probe_concurrent(hash, match);
+}
+
+// false when e is past its expires_at, the wheel drops it within a tick
+// but it's not served meanwhile. Its db row is scheduled for deletion too
+// so the caller doesn't need to look there
+static bool serve(const entry_t &e) {
+  const uint64_t eat = e.expires_at();
+  if (eat != 0 && eat <= util::get_current_ts())
+    return false;
+
+  e.touch();
+  return true;
+}
+
+[[nodiscard]] std::lock_guard<std::shared_mutex>
+acquire_lock(std::string_view key) {
+  return std::lock_guard(get_shard(key).m);
+}
+
+[[nodiscard]] std::shared_lock<std::shared_mutex>
+acquire_shared_lock(std::string_view key) {
+  return std::shared_lock(get_shard(key).m);
+}
+
+static data_t lookup_unlocked(shard_t &shard, std::string_view key,
+                              size_t hash) {
+  auto *e = find_unlocked(shard, key, hash);
+  if (!e)
+    return {};
+
+  return serve(*e) ? e->data() : data_t();
+}
+
+data_t get_unlocked(std::string_view key) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  // misses count too, a key read often enough earns its place once loaded
+  if (shard_max_memory != 0)
+    shard.sketch.increment(hash);
+
+  return lookup_unlocked(shard, key, hash);
+}
+
+data_t get(std::string_view key) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  // a hit doesn't touch the shard lock. Writers bump shard.seq around
+  // every change and a lookup that raced one is retried, entries and
+  // tables they drop stay readable until this thread is quiescent
+  epoch::read_guard_t guard;
+
+  if (shard_max_memory != 0)
+    shard.sketch.increment(hash);
+
+  for (int i = 0; i < optimistic_reads; i++) {
+    const uint64_t seq = shard.seq.load(std::memory_order_acquire);
+
+    // a writer is in, queue on the lock rather than spin
+    if (seq & 1)
+      break;
+
+    value_t::block_t *b;
+    const bool complete = find_concurrent(shard, key, hash, b);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!complete || shard.seq.load(std::memory_order_relaxed) != seq)
+      continue;
+
+    if (!b)
+      return {};
+
+    // replaced or dropped since
+    auto e = entry_t::try_share(b);
+    if (!e)
+      continue;
+
+    return serve(*e) ? std::move(*e).data() : data_t();
+  }
+
+  std::shared_lock lk(shard.m);
+  return lookup_unlocked(shard, key, hash);
+}
+
+get_all_return_t get_all() {
+  std::shared_lock lk(mallcache_m);
+  return {mallcache, mallcache_loaded};
+}
+
+get_all_return_t wait_all(std::chrono::milliseconds timeout) {
+  std::shared_lock lk(mallcache_m);
+  mallcache_cv.wait_for(lk, timeout, [] { return mallcache_loaded; });
+  return {mallcache, mallcache_loaded};
+}
+
+// the loader of a flight is done, wake its waiters with data
+static void land(shard_t &shard, const std::string &key, flight_t &f,
+                 const data_t &data) {
+  // misses from now on start a new flight
+  {
+    std::lock_guard lk(shard.flights_m);
+    shard.flights.erase(key);
+  }
+
+  {
+    std::lock_guard lk(f.m);
+    f.data = data;
+    f.done = true;
+  }
+
+  f.cv.notify_all();
+}
+
+static set_return_t set_unlocked(shard_t &shard, std::string_view key,
+                                 const data_t &value, size_t hash,
+                                 bool from_db) {
+  write_section_t ws(shard);
+
+  // loads from db already got counted by the get that missed
+  if (shard_max_memory != 0 && !from_db)
+    shard.sketch.increment(hash);
+
+  segment_t *seg = &shard.main;
+  auto *e = seg->map.find(key, hash);
+
+  if (!e && shard_max_memory != 0) {
+    seg = &shard.window;
+    e = seg->map.find(key, hash);
+  }
+
+  const bool inserted = e == nullptr;
+  const uint64_t version = from_db ? value.version : next_version();
+
+  // the lease holder would overwrite this set with an older value
+  if (!from_db && !shard.leases.empty())
+    shard.leases.erase(std::string(key));
+
+  if (e) {
+    seg->replace(*e, entry_t(key, value, !from_db, version));
+  } else {
+    // without a memory bound there's nothing to admit, keep everything
+    // in main
+    if (shard_max_memory != 0) {
+      seg = &shard.window;
+
+      const size_t entries = shard.main.map.size() + shard.window.map.size();
+      if (entries >= shard.sketch.capacity())
+        shard.sketch.ensure_capacity(entries * 2);
+    }
+
+    seg->insert(entry_t(key, value, !from_db, version), hash);
+  }
+
+  if (const uint64_t eat = value.get_expires_at(); eat != 0) {
+    if (!shard.wheel)
+      shard.wheel = std::make_unique<timer_wheel_t>(util::get_current_ts());
+
+    shard.wheel->add(hash, eat);
+    shard.has_timers.store(true, std::memory_order_relaxed);
+  }
+
+  evict_unlocked(shard);
+
+  // the entry itself might have been evicted
+  e = find_unlocked(shard, key, hash);
+  return {e ? e->data() : data_t(), inserted};
+}
+
+uint64_t next_version() noexcept {
+  return last_version.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void observe_version(uint64_t version) noexcept {
+  uint64_t v = last_version.load(std::memory_order_relaxed);
+  while (v < version && !last_version.compare_exchange_weak(
+                            v, version, std::memory_order_relaxed))
+    ;
+}
+
+set_return_t set_unlocked(const std::string &key, const data_t &value,
+                          bool from_db) {
+  size_t hash = cache_map_t::hash(key);
+  return set_unlocked(get_shard(hash), key, value, hash, from_db);
+}
+
+set_return_t set(const std::string &key, const data_t &value, bool from_db) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::lock_guard lk(shard.m);
+  return set_unlocked(shard, key, value, hash, from_db);
+}
+
+bool set_condition_t::holds(const data_t &current) const noexcept {
+  if (nx && !current.empty())
+    return false;
+
+  if (xx && current.empty())
+    return false;
+
+  return !if_version ||
+         (!current.empty() && current.version == *if_version);
+}
+
+// loads of a key evicted again before update() got to check it, after that
+// the loaded data is taken as current
+static constexpr int update_loads = 3;
+
+// next(shard, current, value) decides under the shard lock whether key gets
+// set to value from what it currently has. A key missing from memory is read
+// from db with load first, like get_or_load()
+template <typename F>
+static bool update(const std::string &key, const std::function<data_t()> &load,
+                   F &&next, set_return_t &ret, data_t &current) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::optional<data_t> loaded;
+
+  for (int loads = 0;; loads++) {
+    {
+      std::lock_guard lk(shard.m);
+
+      bool known = true;
+
+      // an expired entry is as good as deleted, so is its row
+      if (auto *e = find_unlocked(shard, key, hash))
+        current = serve(*e) ? e->data() : data_t();
+      else if (loaded && (loaded->empty() || loads >= update_loads))
+        current = *loaded;
+      else if (known_absent(key))
+        current = {};
+      else
+        known = false;
+
+      if (known) {
+        data_t value;
+        if (!next(shard, std::as_const(current), value))
+          return false;
+
+        ret = set_unlocked(shard, key, value, hash, false);
+        return true;
+      }
+    }
+
+    loaded = get_or_load(key, load);
+  }
+}
+
+// the live lease of key in shard, nullptr when there's none
+static lease_t *find_lease_unlocked(shard_t &shard, const std::string &key,
+                                    uint64_t now) {
+  auto it = shard.leases.find(key);
+  if (it == shard.leases.end())
+    return nullptr;
+
+  if (it->second.expires_at <= now) {
+    shard.leases.erase(it);
+    return nullptr;
+  }
+
+  return &it->second;
+}
+
+set_if_result_t set_if(const std::string &key, const data_t &value,
+                       const set_condition_t &cond,
+                       const std::function<data_t()> &load,
+                       set_return_t &ret, data_t &current) {
+  set_if_result_t result = set_done;
+
+  update(
+      key, load,
+      [&](shard_t &shard, const data_t &cur, data_t &next) {
+        if (cond.lease) {
+          const auto *l =
+              find_lease_unlocked(shard, key, util::get_current_ts());
+
+          if (!l || l->token != *cond.lease) {
+            result = set_no_lease;
+            return false;
+          }
+        }
+
+        if (!cond.holds(cur)) {
+          result = set_unmet;
+          return false;
+        }
+
+        next = value;
+        return true;
+      },
+      ret, current);
+
+  return result;
+}
+
+// leases or refresh claims left in a shard after a sweep are never swept
+// again before there are this many
+static constexpr size_t sweep_min = 64;
+
+lease_result_t acquire_lease(const std::string &key, uint64_t ttl,
+                             lease_t &lease) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+  const uint64_t now = util::get_current_ts();
+
+  std::lock_guard lk(shard.m);
+
+  if (auto *e = find_unlocked(shard, key, hash); e && serve(*e))
+    return lease_cached;
+
+  if (const auto *l = find_lease_unlocked(shard, key, now)) {
+    lease = *l;
+    return lease_taken;
+  }
+
+  if (shard.leases.size() >= shard.lease_sweep_at) {
+    for (auto it = shard.leases.begin(); it != shard.leases.end();) {
+      if (it->second.expires_at <= now)
+        it = shard.leases.erase(it);
+      else
+        ++it;
+    }
+
+    shard.lease_sweep_at = std::max(sweep_min, shard.leases.size() * 2);
+  }
+
+  // unique across restarts too, a lease can't outlive the process anyway
+  lease = {next_version(), now + ttl};
+  shard.leases.emplace(key, lease);
+
+  return lease_granted;
+}
+
+// xorshift64, seeded apart per thread so threads don't draw in lockstep.
+// Uniform in (0, 1]
+static double draw() noexcept {
+  static thread_local uint64_t state =
+      std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+
+  return static_cast<double>((state >> 11) + 1) * 0x1p-53;
+}
+
+bool refresh_early(std::string_view key, const data_t &data, double beta) {
+  if (data.delta == 0 || data.expires_at == 0 || beta <= 0)
+    return false;
+
+  const uint64_t now = util::get_current_ts();
+  if (now >= data.expires_at)
+    return false;
+
+  // now - delta * beta * ln(rand()) >= expiry
+  const double gap = static_cast<double>(data.expires_at - now);
+  if (-static_cast<double>(data.delta) * beta * std::log(draw()) < gap)
+    return false;
+
+  // data can be a near cache copy or a load result, and the entry can be
+  // evicted and loaded again, the claim is kept by key and version
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::lock_guard lk(shard.m);
+
+  // memory holds a newer one already
+  if (const auto *e = find_unlocked(shard, key, hash);
+      e && e->version() != data.version)
+    return false;
+
+  if (shard.refreshes.size() >= shard.refresh_sweep_at) {
+    for (auto it = shard.refreshes.begin(); it != shard.refreshes.end();) {
+      if (it->second.expires_at <= now)
+        it = shard.refreshes.erase(it);
+      else
+        ++it;
+    }
+
+    shard.refresh_sweep_at =
+        std::max(sweep_min, shard.refreshes.size() * 2);
+  }
+
+  auto [it, claimed] = shard.refreshes.try_emplace(
+      std::string(key), refresh_claim_t{data.version, data.expires_at});
+
+  if (!claimed) {
+    if (it->second.version == data.version)
+      return false;
+
+    it->second = {data.version, data.expires_at};
+  }
+
+  return true;
+}
+
+incr_result_t incr(const std::string &key, int64_t delta, uint64_t expires_at,
+                   const std::function<data_t()> &load, set_return_t &ret) {
+  incr_result_t result = incr_done;
+  data_t current;
+
+  update(
+      key, load,
+      [&](shard_t &, const data_t &cur, data_t &next) {
+        int64_t n = 0;
+
+        if (!cur.empty()) {
+          const value_t plain = cur.plain();
+          const auto v = plain.view();
+          const auto [end, ec] =
+              std::from_chars(v.data(), v.data() + v.size(), n);
+
+          if (v.empty() || ec != std::errc() || end != v.data() + v.size()) {
+            result = incr_not_integer;
+            return false;
+          }
+        }
+
+        if ((delta > 0 && n > std::numeric_limits<int64_t>::max() - delta) ||
+            (delta < 0 && n < std::numeric_limits<int64_t>::min() - delta)) {
+          result = incr_overflow;
+          return false;
+        }
+
+        next.value = value_t(std::to_string(n + delta));
+        next.expires_at = expires_at != 0 ? expires_at : cur.expires_at;
+        next.delta = cur.delta;
+        return true;
+      },
+      ret, current);
+
+  return result;
+}
+
+bool get_unpersisted(std::string_view key, data_t &out) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::lock_guard lk(shard.m);
+
+  auto *e = find_unlocked(shard, key, hash);
+  if (!e || !e->dirty() || !serve(*e))
+    return false;
+
+  out = e->data();
+  return true;
+}
+
+std::vector<uint64_t> delete_marks() {
+  std::vector<uint64_t> ret(shard_count);
+
+  for (size_t i = 0; i < shard_count; i++)
+    ret[i] = shards[i].deletes.load();
+
+  return ret;
+}
+
+size_t warm(std::vector<std::pair<std::string, data_t>> &rows,
+            const std::vector<uint64_t> &marks) {
+  struct row_t {
+    shard_t *shard;
+    size_t hash;
+    size_t i;
+  };
+
+  std::vector<row_t> order;
+  order.reserve(rows.size());
+
+  for (size_t i = 0; i < rows.size(); i++) {
+    size_t hash = cache_map_t::hash(rows[i].first);
+    order.push_back({&get_shard(hash), hash, i});
+  }
+
+  std::sort(order.begin(), order.end(), [](const row_t &a, const row_t &b) {
+    return a.shard < b.shard;
+  });
+
+  size_t ret = 0;
+
+  for (size_t i = 0; i < order.size();) {
+    shard_t &shard = *order[i].shard;
+    std::lock_guard lk(shard.m);
+
+    if (shard.deletes.load() != marks[&shard - shards.get()]) {
+      while (i < order.size() && order[i].shard == &shard)
+        i++;
+      continue;
+    }
+
+    for (; i < order.size() && order[i].shard == &shard; i++) {
+      const auto &[key, data] = rows[order[i].i];
+
+      auto *e = find_unlocked(shard, key, order[i].hash);
+      if (e && serve(*e))
+        continue;
+
+      set_unlocked(shard, key, data, order[i].hash, true);
+      ret++;
+    }
+  }
+
+  return ret;
+}
+
+void mark_persisted(const std::string &key, const data_t &data,
+                    bool inserted) {
+  size_t hash = cache_map_t::hash(key);
+
+  // until they're loaded the scans pick this up from db
+  if (auto *f = key_filter.load(std::memory_order_relaxed); f && inserted)
+    f->add(hash);
+
+  if (inserted) {
+    std::lock_guard lk(key_index_m);
+    if (key_index)
+      key_index->insert(key);
+  }
+
+  {
+    std::lock_guard lk(mallcache_m);
+    if (mallcache_loaded) {
+      if (const auto *old = mallcache.find(key))
+        mallcache_bytes -= view_row_bytes(key, *old);
+
+      mallcache.set(key, data);
+      mallcache_bytes += view_row_bytes(key, data);
+    }
+  }
+
+  auto &shard = get_shard(hash);
+
+  std::lock_guard lk(shard.m);
+
+  // set again since
+  segment_t *seg = &shard.main;
+  auto *e = seg->map.find(key, hash);
+
+  if (!e && shard_max_memory != 0) {
+    seg = &shard.window;
+    e = seg->map.find(key, hash);
+  }
+
+  if (!e || e->version() != data.version)
+    return;
+
+  seg->clear_dirty(*e);
+
+  write_section_t ws(shard);
+  evict_unlocked(shard);
+}
+
+void mark_deleted(const std::string &key) {
+  const size_t hash = cache_map_t::hash(key);
+
+  // before del_persisted() takes the shard lock, a load that read the row
+  // either sees this or cached it before and gets dropped there
+  get_shard(hash).deletes.fetch_add(1);
+
+  if (auto *f = key_filter.load(std::memory_order_relaxed))
+    f->remove(hash);
+
+  {
+    std::lock_guard lk(key_index_m);
+    if (key_index)
+      key_index->erase(key);
+  }
+
+  {
+    std::lock_guard lk(tag_index_m);
+    if (tag_index)
+      tag_index->erase(key);
+  }
+
+  std::lock_guard lk(mallcache_m);
+  if (!mallcache_loaded)
+    return;
+
+  if (const auto *old = mallcache.find(key)) {
+    mallcache_bytes -= view_row_bytes(key, *old);
+    mallcache.erase(key);
+  }
+}
+
+size_t key_hash(std::string_view key) noexcept {
+  return cache_map_t::hash(key);
+}
+
+bool known_absent(std::string_view key) {
+  // a replaced filter is retired
+  epoch::read_guard_t guard;
+
+  const auto *f = key_filter.load(std::memory_order_acquire);
+  return f && !f->may_contain(cache_map_t::hash(key));
+}
+
+void set_key_filter(std::unique_ptr<key_filter_t> &&filter) {
+  auto *old = key_filter.exchange(filter.release(), std::memory_order_acq_rel);
+
+  if (old)
+    epoch::retire(old, old->memory_usage(), [](void *p, size_t) {
+      delete static_cast<key_filter_t *>(p);
+    });
+}
+
+bool key_filter_full() noexcept {
+  const auto *f = key_filter.load(std::memory_order_relaxed);
+  return f && f->size() > f->capacity();
+}
+
+std::vector<std::string> list_keys(std::string_view prefix,
+                                   std::string_view after, size_t limit) {
+  std::shared_lock lk(key_index_m);
+  if (!key_index)
+    return {};
+
+  return key_index->range(prefix, after, limit);
+}
+
+void set_key_index(std::unique_ptr<key_index_t> &&index) {
+  std::unique_ptr<key_index_t> old;
+
+  {
+    std::lock_guard lk(key_index_m);
+    old = std::exchange(key_index, std::move(index));
+  }
+
+  // freed outside the lock, it can be big
+}
+
+std::vector<std::string> tagged_keys(const std::string &tag) {
+  std::shared_lock lk(tag_index_m);
+  if (!tag_index)
+    return {};
+
+  return tag_index->keys(tag);
+}
+
+bool has_tags(const std::string &key) {
+  std::shared_lock lk(tag_index_m);
+  return tag_index && tag_index->has(key);
+}
+
+void mark_tagged(const std::string &key,
+                 const std::vector<std::string> &tags) {
+  std::lock_guard lk(tag_index_m);
+  if (tag_index)
+    tag_index->set(key, tags);
+}
+
+void set_tag_index(std::unique_ptr<tag_index_t> &&index) {
+  std::unique_ptr<tag_index_t> old;
+
+  {
+    std::lock_guard lk(tag_index_m);
+    old = std::exchange(tag_index, std::move(index));
+  }
+
+  // freed outside the lock, it can be big
+}
+
+void set_all(all_data_t &&all) {
+  {
+    size_t bytes = 0;
+    all.for_each([&bytes](const std::string &key, const data_t &d) {
+      bytes += view_row_bytes(key, d);
+    });
+
+    std::lock_guard lk(mallcache_m);
+    mallcache = std::move(all);
+    mallcache_bytes = bytes;
+    mallcache_loaded = true;
+  }
+
+  mallcache_cv.notify_all();
+}
+
+static size_t del_unlocked(shard_t &shard, std::string_view key,
+                           size_t hash) {
+  write_section_t ws(shard);
+
+  if (size_t n = shard.main.erase(key, hash))
+    return n;
+
+  return shard.window.erase(key, hash);
+}
+
+size_t del_unlocked(std::string_view key) {
+  size_t hash = cache_map_t::hash(key);
+  return del_unlocked(get_shard(hash), key, hash);
+}
+
+// a delete revokes the lease on key, the holder's value might be older
+static void revoke_lease_unlocked(shard_t &shard, std::string_view key) {
+  if (!shard.leases.empty())
+    shard.leases.erase(std::string(key));
+}
+
+size_t del(std::string_view key) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::lock_guard lk(shard.m);
+
+  revoke_lease_unlocked(shard, key);
+  return del_unlocked(shard, key, hash);
+}
+
+size_t del_prefix(std::string_view prefix) {
+  auto match = [prefix](const entry_t &e) {
+    return e.key().substr(0, prefix.size()) == prefix;
+  };
+
+  size_t ret = 0;
+
+  for (size_t i = 0; i < shard_count; i++) {
+    auto &shard = shards[i];
+
+    std::lock_guard lk(shard.m);
+    write_section_t ws(shard);
+
+    for (auto it = shard.leases.begin(); it != shard.leases.end();) {
+      if (std::string_view(it->first).substr(0, prefix.size()) == prefix)
+        it = shard.leases.erase(it);
+      else
+        ++it;
+    }
+
+    for (segment_t *seg : {&shard.main, &shard.window}) {
+      for (size_t j = 0; j < seg->map.capacity(); j++) {
+        if (!seg->map.full_at(j) || !match(seg->map.at(j)))
+          continue;
+
+        seg->erase_at(j);
+        ret++;
+      }
+    }
+  }
+
+  return ret;
+}
+
+size_t del_persisted(std::string_view key) {
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::lock_guard lk(shard.m);
+
+  auto *e = find_unlocked(shard, key, hash);
+  if (!e || e->dirty())
+    return 0;
+
+  revoke_lease_unlocked(shard, key);
+  return del_unlocked(shard, key, hash);
+}
+
+data_t load_missed(std::string_view key,
+                   const std::function<data_t()> &load) {
+  data_t ret;
+
+  size_t hash = cache_map_t::hash(key);
+  auto &shard = get_shard(hash);
+
+  std::shared_ptr<flight_t> f;
+  bool loader = false;
+
+  // misses are about to wait on db anyway
+  const std::string str_key(key);
+
+  {
+    std::lock_guard lk(shard.flights_m);
+
+    auto &slot = shard.flights[str_key];
+    if (!slot) {
+      slot = std::make_shared<flight_t>();
+      loader = true;
+    }
+
+    f = slot;
+  }
+
+  if (!loader) {
+    std::unique_lock lk(f->m);
+    f->cv.wait(lk, [&f] { return f->done; });
+    return f->data;
+  }
+
+  try {
+    const uint64_t deletes = shard.deletes.load();
+
+    ret = load();
+
+    std::lock_guard lk(shard.m);
+
+    // a set that landed while loading is newer than what db had. So is a
+    // load finished between the miss and taking the flight, same data. A
+    // row deleted since it was read isn't cached, the writer already
+    // looked for it in memory
+    auto *e = find_unlocked(shard, key, hash);
+    if (e && serve(*e))
+      ret = e->data();
+    else if (!ret.empty() && shard.deletes.load() == deletes)
+      set_unlocked(shard, key, ret, hash, true);
+  } catch (...) {
+    land(shard, str_key, *f, data_t());
+    throw;
+  }
+
+  land(shard, str_key, *f, ret);
+  return ret;
 }
 
 } // namespace ssplus_cache_me::cache
@@ -0,0 +1,221 @@
+#include "ssplus-cache-me/codec.h"
+#include "ssplus-cache-me/debug.h"
+#include "ssplus-cache-me/log.h"
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <mutex>
+#include <strings.h>
+#include <zlib.h>
+
+DECLARE_DEBUG_INFO_DEFAULT();
+
+namespace ssplus_cache_me::codec {
+
+// windowBits for deflateInit2()/inflateInit2() to write and read a gzip
+// header and trailer instead of a zlib one
+static constexpr int gzip_window_bits = 15 + 16;
+
+// largest decompressed size trusted from a gzip trailer to reserve up front
+static constexpr size_t max_reserve = size_t{64} << 20;
+
+struct registry_t {
+  std::mutex m;
+  std::vector<const stats_t *> list;
+};
+
+// never destroyed, stats_t are function local statics of the handlers
+static registry_t &get_registry() {
+  static registry_t &r = *new registry_t;
+  return r;
+}
+
+static stats_t &get_other() {
+  static stats_t &st = *new stats_t("other");
+  return st;
+}
+
+static thread_local stats_t *current = nullptr;
+
+static stats_t &get_current() { return current ? *current : get_other(); }
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+stats_t::stats_t(const char *_endpoint) : endpoint(_endpoint) {
+  auto &r = get_registry();
+
+  std::lock_guard lk(r.m);
+  r.list.push_back(this);
+}
+
+std::vector<const stats_t *> get_stats() {
+  // make sure it's listed even before anything got counted
+  get_other();
+
+  auto &r = get_registry();
+
+  std::lock_guard lk(r.m);
+  return r.list;
+}
+
+scope_t::scope_t(stats_t &st) noexcept : prev(current) { current = &st; }
+
+scope_t::~scope_t() { current = prev; }
+
+std::string gzip_compress(std::string_view s) {
+  std::string ret;
+
+  if (s.size() > UINT_MAX)
+    return ret;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip_window_bits,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    log::io() << DEBUG_WHERE << "deflateInit2() failed: "
+              << (zs.msg ? zs.msg : "") << "\n";
+    return ret;
+  }
+
+  ret.resize(deflateBound(&zs, static_cast<uLong>(s.size())));
+
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(s.data()));
+  zs.avail_in = static_cast<uInt>(s.size());
+  zs.next_out = reinterpret_cast<Bytef *>(ret.data());
+  zs.avail_out = static_cast<uInt>(ret.size());
+
+  // the bound fits it all in one go
+  const int status = deflate(&zs, Z_FINISH);
+  deflateEnd(&zs);
+
+  if (status != Z_STREAM_END) {
+    log::io() << DEBUG_WHERE << "deflate() failed with status(" << status
+              << ")\n";
+    ret.clear();
+    return ret;
+  }
+
+  ret.resize(zs.total_out);
+
+  auto &st = get_current();
+  st.compressed.fetch_add(1, std::memory_order_relaxed);
+  st.compressed_in.fetch_add(s.size(), std::memory_order_relaxed);
+  st.compressed_out.fetch_add(ret.size(), std::memory_order_relaxed);
+  st.compress_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+
+  return ret;
+}
+
+bool gzip_decompress(std::string_view s, std::string &out) {
+  out.clear();
+
+  // header and trailer alone are 18 bytes
+  if (s.size() < 18 || s.size() > UINT_MAX)
+    return false;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // the trailer ends with the decompressed size mod 2^32
+  const auto *t = reinterpret_cast<const unsigned char *>(s.data()) +
+                  s.size() - 4;
+  const size_t isize = size_t{t[0]} | size_t{t[1]} << 8 | size_t{t[2]} << 16 |
+                       size_t{t[3]} << 24;
+
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+
+  if (inflateInit2(&zs, gzip_window_bits) != Z_OK) {
+    log::io() << DEBUG_WHERE << "inflateInit2() failed: "
+              << (zs.msg ? zs.msg : "") << "\n";
+    return false;
+  }
+
+  out.resize(isize < max_reserve ? isize + 1 : max_reserve);
+
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(s.data()));
+  zs.avail_in = static_cast<uInt>(s.size());
+
+  int status;
+  do {
+    if (zs.total_out == out.size())
+      out.resize(out.size() * 2);
+
+    const size_t room = out.size() - zs.total_out;
+    zs.next_out = reinterpret_cast<Bytef *>(out.data() + zs.total_out);
+    zs.avail_out = static_cast<uInt>(room < UINT_MAX ? room : UINT_MAX);
+
+    status = inflate(&zs, Z_NO_FLUSH);
+  } while (status == Z_OK);
+
+  const bool ok = status == Z_STREAM_END && zs.avail_in == 0;
+  out.resize(ok ? zs.total_out : 0);
+  inflateEnd(&zs);
+
+  if (!ok) {
+    log::io() << DEBUG_WHERE << "inflate() failed with status(" << status
+              << ")\n";
+    return false;
+  }
+
+  auto &st = get_current();
+  st.decompressed.fetch_add(1, std::memory_order_relaxed);
+  st.decompressed_in.fetch_add(s.size(), std::memory_order_relaxed);
+  st.decompressed_out.fetch_add(out.size(), std::memory_order_relaxed);
+  st.decompress_ns.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+
+  return true;
+}
+
+void count_passthrough() noexcept {
+  get_current().passthrough.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool accepts_gzip(std::string_view accept_encoding) noexcept {
+  // comma separated codings, each optionally followed by ;q=<weight>
+  while (!accept_encoding.empty()) {
+    size_t end = accept_encoding.find(',');
+    std::string_view item = accept_encoding.substr(0, end);
+    accept_encoding.remove_prefix(end == std::string_view::npos
+                                      ? accept_encoding.size()
+                                      : end + 1);
+
+    std::string_view params;
+    if (size_t semi = item.find(';'); semi != std::string_view::npos) {
+      params = item.substr(semi + 1);
+      item = item.substr(0, semi);
+    }
+
+    while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+      item.remove_prefix(1);
+    while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+      item.remove_suffix(1);
+
+    if (item.size() != 4 || strncasecmp(item.data(), "gzip", 4) != 0)
+      continue;
+
+    // q=0, q=0.0, ... explicitly refuses it
+    size_t q = params.find("q=");
+    if (q == std::string_view::npos)
+      return true;
+
+    for (char c : params.substr(q + 2)) {
+      if (c >= '1' && c <= '9')
+        return true;
+      if (c != '0' && c != '.')
+        break;
+    }
+
+    return false;
+  }
+
+  return false;
+}
+
+} // namespace ssplus_cache_me::codec
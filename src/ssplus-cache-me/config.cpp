@@ -20,56 +20,96 @@ namespace ssplus_cache_me::config {
  * Lets decide our env config here:
  *
  * Program configs:
- * SPLUS_CONCURRENCY : unsigned integer, number of thread which run the
- *                     server
- * SPLUS_CONF        : string, path to JSON config, this will be loaded
- *                     first if exist before other env config
+ * SPLUS_CONCURRENCY  : unsigned integer, number of thread which run the
+ *                      server
+ * SPLUS_CONF         : string, path to JSON config, this will be loaded
+ *                      first if exist before other env config
+ * SPLUS_CACHE_SHARDS : unsigned integer, number of memory cache shards,
+ *                      rounded up to power of two
+ * SPLUS_MAX_MEMORY   : unsigned integer, memory cache size limit in bytes
+ * SPLUS_HUGE_PAGES   : unsigned integer, non zero backs memory cache storage
+ *                      with 2MB huge pages
+ * SPLUS_COMPRESS_MIN_SIZE : unsigned integer, values of at least this many
+ *                      bytes are stored gzip compressed, 0 disables
+ * SPLUS_WARM_UP      : unsigned integer, number of thread warming up the
+ *                      memory cache from db on boot, 0 disables
  *
  * Server configs:
  * PORT               : unsigned integer, any valid port
  * SPLUS_CORS_MAX_AGE : unsigned integer, for cors Access-Control-Max-Age header
  * SPLUS_ALLOW_CORS   : string, a list, coma separated origins
  * SPLUS_DB           : string, path to sqlite db
+ * SPLUS_L1_ENTRIES   : unsigned integer, entries of each server thread's near
+ *                      cache of hot keys, 0 disables
  *
  */
 inline constexpr const struct {
   const char *config_path = "SPLUS_CONF";
 
   const char *concurrency = "SPLUS_CONCURRENCY";
+  const char *cache_shards = "SPLUS_CACHE_SHARDS";
+  const char *max_memory = "SPLUS_MAX_MEMORY";
+  const char *huge_pages = "SPLUS_HUGE_PAGES";
+  const char *compress_min_size = "SPLUS_COMPRESS_MIN_SIZE";
+  const char *warm_up = "SPLUS_WARM_UP";
   const char *port = "PORT";
   const char *cors_max_age = "SPLUS_CORS_MAX_AGE";
   const char *allow_cors = "SPLUS_ALLOW_CORS";
   const char *database = "SPLUS_DB";
+  const char *l1_entries = "SPLUS_L1_ENTRIES";
 } env_keys;
 
 /**
  * JSON for config format:
  *
  * Program configs:
- * concurrency : unsigned integer, number of thread which run the
- *               server
+ * concurrency  : unsigned integer, number of thread which run the
+ *                server
+ * cache_shards : unsigned integer, number of memory cache shards, rounded up
+ *                to power of two
+ * max_memory   : unsigned integer, memory cache size limit in bytes, entries
+ *                over the limit are evicted from memory but stay in db
+ * huge_pages   : boolean, back memory cache storage with 2MB huge pages
+ * compress_min_size : unsigned integer, values of at least this many bytes
+ *                are stored gzip compressed in memory and in db, 0 disables
+ * warm_up      : unsigned integer, number of thread warming up the memory
+ *                cache from db on boot, 0 disables
  *
  * Server configs:
  * port         : unsigned integer, any valid port
  * cors_max_age : unsigned integer, for cors Access-Control-Max-Age header
  * allow_cors   : string, a list, coma separated origins
  * database     : string, path to sqlite db
+ * l1_entries   : unsigned integer, entries of each server thread's near cache
+ *                of hot keys, 0 disables
  *
  * Example:
  * {
  *    "concurrency": 8,
+ *    "cache_shards": 32,
+ *    "max_memory": 1073741824,
+ *    "huge_pages": false,
+ *    "compress_min_size": 1024,
+ *    "warm_up": 4,
  *    "port": 3000,
  *    "cors_max_age": 86400,
  *    "allow_cors": "https://www.google.com,https://www.yahoo.com",
- *    "database": "/home/app/cache.sqlite3"
+ *    "database": "/home/app/cache.sqlite3",
+ *    "l1_entries": 1024
  * }
  */
 inline constexpr const struct {
   const char *concurrency = "concurrency";
+  const char *cache_shards = "cache_shards";
+  const char *max_memory = "max_memory";
+  const char *huge_pages = "huge_pages";
+  const char *compress_min_size = "compress_min_size";
+  const char *warm_up = "warm_up";
   const char *port = "port";
   const char *cors_max_age = "cors_max_age";
   const char *allow_cors = "allow_cors";
   const char *database = "database";
+  const char *l1_entries = "l1_entries";
 } json_keys;
 
 /**
@@ -78,12 +118,22 @@ inline constexpr const struct {
  * Program configs:
  * -t, --concurrency  : unsigned integer, number of thread which run the server
  * -c, --config       : string, path to json config
+ * -s, --cache-shards : unsigned integer, number of memory cache shards
+ * -M, --max-memory   : unsigned integer, memory cache size limit in bytes
+ * -H, --huge-pages   : no argument, back memory cache storage with 2MB huge
+ *                      pages
+ * -z, --compress-min-size : unsigned integer, values of at least this many
+ *                      bytes are stored gzip compressed
+ * -w, --warm-up      : unsigned integer, number of thread warming up the
+ *                      memory cache from db on boot
  *
  * Server configs:
  * -p, --port         : unsigned integer, any valid port
  * -m, --cors-max-age : unsigned integer, for cors Access-Control-Max-Age header
  * -a, --allow-cors   : string, a list, coma separated origins
  * -d, --database     : string, path to sqlite db
+ * -l, --l1-entries   : unsigned integer, entries of each server thread's near
+ *                      cache of hot keys
  *
  * Non-config arguments:
  * -h, --help        : print help
@@ -104,6 +154,20 @@ static void print_usage() {
                   "CPU cores."},
                  {"-c, --config", "</path/to/conf.json>",
                   "Load configuration from a JSON file."},
+                 {"-s, --cache-shards", "<uint>",
+                  "Number of memory cache shards, rounded up to power of two. "
+                  "Default is 4 times concurrency."},
+                 {"-M, --max-memory", "<bytes>",
+                  "Memory cache size limit, least recently used entries are "
+                  "evicted from memory. Default 0, unbounded."},
+                 {"-H, --huge-pages", "",
+                  "Back memory cache storage with 2MB huge pages."},
+                 {"-z, --compress-min-size", "<bytes>",
+                  "Store values of at least this size gzip compressed in "
+                  "memory and in db. Default 0, disabled."},
+                 {"-w, --warm-up", "<uint>",
+                  "Number of thread loading db into the memory cache on boot, "
+                  "GET /ready answers 503 until done. Default 0, disabled."},
 
                  {"-p, --port", "<uint>", "Port to listen on. Default 3000."},
                  {"-m, --cors-max-age", "<uint>",
@@ -112,7 +176,10 @@ static void print_usage() {
                  {"-a, --allow-cors", "<origins...>",
                   "List of origin enabled for CORS, separated by coma (,)."},
                  {"-d, --database", "</path/to/db.sqlite3>",
-                  "Cache database to use. Default \"cache.sqlite3\""}};
+                  "Cache database to use. Default \"cache.sqlite3\""},
+                 {"-l, --l1-entries", "<uint>",
+                  "Entries of each server thread's near cache of hot keys. "
+                  "Default 0, disabled."}};
 
   for (size_t i = 0; i < sizeof(arglist) / sizeof(*arglist); i++) {
     auto &v = arglist[i];
@@ -123,10 +190,17 @@ static void print_usage() {
 
 inline constexpr const struct {
   const char *invalid_concurrency = "Invalid concurrency, skipping";
+  const char *invalid_cache_shards = "Invalid cache_shards, skipping";
+  const char *invalid_max_memory = "Invalid max_memory, skipping";
+  const char *invalid_huge_pages = "Invalid huge_pages, skipping";
+  const char *invalid_compress_min_size =
+      "Invalid compress_min_size, skipping";
+  const char *invalid_warm_up = "Invalid warm_up, skipping";
   const char *invalid_port = "Invalid port, skipping";
   const char *invalid_cors = "Invalid allow_cors, skipping";
   const char *invalid_database = "Invalid database, skipping";
   const char *invalid_cors_max_age = "Invalid cors_max_age, skipping";
+  const char *invalid_l1_entries = "Invalid l1_entries, skipping";
   /*const char *invalid_;*/
 } error_messages;
 
@@ -142,6 +216,47 @@ static void str_set_concurrency(main_t &main_state, char *str_concurrency) {
   }
 }
 
+static void str_set_cache_shards(main_t &main_state, char *str_cache_shards) {
+  int val = atoi(str_cache_shards);
+  if (val < 1) {
+    log::io() << error_messages.invalid_cache_shards << "\n";
+  } else {
+    main_state.cache_conf.shard_count = val;
+  }
+}
+
+static void str_set_max_memory(main_t &main_state, char *str_max_memory) {
+  uint64_t val = strtoull(str_max_memory, NULL, 10);
+  if (val == ULLONG_MAX) {
+    log::io() << error_messages.invalid_max_memory << "\n";
+  } else {
+    main_state.cache_conf.max_memory = val;
+  }
+}
+
+static void str_set_huge_pages(main_t &main_state, char *str_huge_pages) {
+  main_state.cache_conf.huge_pages = atoi(str_huge_pages) != 0;
+}
+
+static void str_set_compress_min_size(main_t &main_state,
+                                      char *str_compress_min_size) {
+  uint64_t val = strtoull(str_compress_min_size, NULL, 10);
+  if (val == ULLONG_MAX) {
+    log::io() << error_messages.invalid_compress_min_size << "\n";
+  } else {
+    main_state.cache_conf.compress_min_size = val;
+  }
+}
+
+static void str_set_warm_up(main_t &main_state, char *str_warm_up) {
+  int val = atoi(str_warm_up);
+  if (val < 0) {
+    log::io() << error_messages.invalid_warm_up << "\n";
+  } else {
+    main_state.warm_up_threads = val;
+  }
+}
+
 static void str_set_port(server::server_config_t &sconf, char *str_port) {
   int val = atoi(str_port);
   if (!valid_port(val)) {
@@ -161,6 +276,16 @@ static void str_set_cors_max_age(server::server_config_t &sconf,
   }
 }
 
+static void str_set_l1_entries(server::server_config_t &sconf,
+                               char *str_l1_entries) {
+  uint64_t val = strtoull(str_l1_entries, NULL, 10);
+  if (val == ULLONG_MAX) {
+    log::io() << error_messages.invalid_l1_entries << "\n";
+  } else {
+    sconf.l1_entries = val;
+  }
+}
+
 void load_env(main_t &main_state, server::server_config_t &sconf) {
   auto has = [](char *v) -> bool { return v && strlen(v) > 0; };
 
@@ -176,6 +301,31 @@ void load_env(main_t &main_state, server::server_config_t &sconf) {
     str_set_concurrency(main_state, str_concurrency);
   }
 
+  char *str_cache_shards = std::getenv(env_keys.cache_shards);
+  if (has(str_cache_shards)) {
+    str_set_cache_shards(main_state, str_cache_shards);
+  }
+
+  char *str_max_memory = std::getenv(env_keys.max_memory);
+  if (has(str_max_memory)) {
+    str_set_max_memory(main_state, str_max_memory);
+  }
+
+  char *str_huge_pages = std::getenv(env_keys.huge_pages);
+  if (has(str_huge_pages)) {
+    str_set_huge_pages(main_state, str_huge_pages);
+  }
+
+  char *str_compress_min_size = std::getenv(env_keys.compress_min_size);
+  if (has(str_compress_min_size)) {
+    str_set_compress_min_size(main_state, str_compress_min_size);
+  }
+
+  char *str_warm_up = std::getenv(env_keys.warm_up);
+  if (has(str_warm_up)) {
+    str_set_warm_up(main_state, str_warm_up);
+  }
+
   char *str_port = std::getenv(env_keys.port);
   if (has(str_port)) {
     str_set_port(sconf, str_port);
@@ -195,6 +345,11 @@ void load_env(main_t &main_state, server::server_config_t &sconf) {
   if (has(str_db)) {
     sconf.db_path = str_db;
   }
+
+  char *str_l1_entries = std::getenv(env_keys.l1_entries);
+  if (has(str_l1_entries)) {
+    str_set_l1_entries(sconf, str_l1_entries);
+  }
 }
 
 void parse_json_config(main_t &main_state, server::server_config_t &sconf,
@@ -226,6 +381,51 @@ void parse_json_config(main_t &main_state, server::server_config_t &sconf,
     }
   }
 
+  i = data.find(json_keys.cache_shards);
+  if (i != data.end()) {
+    if (!i->is_number_unsigned() || i->get<uint64_t>() < 1) {
+      log::io() << error_messages.invalid_cache_shards << "\n";
+    } else {
+      main_state.cache_conf.shard_count = i->get<size_t>();
+    }
+  }
+
+  i = data.find(json_keys.max_memory);
+  if (i != data.end()) {
+    if (!i->is_number_unsigned()) {
+      log::io() << error_messages.invalid_max_memory << "\n";
+    } else {
+      main_state.cache_conf.max_memory = i->get<size_t>();
+    }
+  }
+
+  i = data.find(json_keys.huge_pages);
+  if (i != data.end()) {
+    if (!i->is_boolean()) {
+      log::io() << error_messages.invalid_huge_pages << "\n";
+    } else {
+      main_state.cache_conf.huge_pages = i->get<bool>();
+    }
+  }
+
+  i = data.find(json_keys.compress_min_size);
+  if (i != data.end()) {
+    if (!i->is_number_unsigned()) {
+      log::io() << error_messages.invalid_compress_min_size << "\n";
+    } else {
+      main_state.cache_conf.compress_min_size = i->get<size_t>();
+    }
+  }
+
+  i = data.find(json_keys.warm_up);
+  if (i != data.end()) {
+    if (!i->is_number_unsigned()) {
+      log::io() << error_messages.invalid_warm_up << "\n";
+    } else {
+      main_state.warm_up_threads = i->get<int>();
+    }
+  }
+
   i = data.find(json_keys.port);
   if (i != data.end()) {
     int val = 0;
@@ -266,6 +466,15 @@ void parse_json_config(main_t &main_state, server::server_config_t &sconf,
       sconf.db_path = v;
     }
   }
+
+  i = data.find(json_keys.l1_entries);
+  if (i != data.end()) {
+    if (!i->is_number_unsigned()) {
+      log::io() << error_messages.invalid_l1_entries << "\n";
+    } else {
+      sconf.l1_entries = i->get<size_t>();
+    }
+  }
 }
 
 // if returns 1 should exit with status zero
@@ -279,15 +488,21 @@ int parse_args(main_t &main_state, server::server_config_t &sconf, int argc,
     static struct option long_options[] = {
         {"concurrency", required_argument, 0, 't'},
         {"config", required_argument, 0, 'c'},
+        {"cache-shards", required_argument, 0, 's'},
+        {"max-memory", required_argument, 0, 'M'},
+        {"huge-pages", no_argument, 0, 'H'},
+        {"compress-min-size", required_argument, 0, 'z'},
+        {"warm-up", required_argument, 0, 'w'},
         {"port", required_argument, 0, 'p'},
         {"cors-max-age", required_argument, 0, 'm'},
         {"allow-cors", required_argument, 0, 'a'},
         {"database", required_argument, 0, 'd'},
+        {"l1-entries", required_argument, 0, 'l'},
 
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
 
-    c = getopt_long(argc, argv, "t:c:p:m:a:d:h", long_options, &option_index);
+    c = getopt_long(argc, argv, "t:c:s:M:Hz:w:p:m:a:d:l:h", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -308,6 +523,21 @@ int parse_args(main_t &main_state, server::server_config_t &sconf, int argc,
     case 'c':
       parse_json_config(main_state, sconf, optarg);
       break;
+    case 's':
+      str_set_cache_shards(main_state, optarg);
+      break;
+    case 'M':
+      str_set_max_memory(main_state, optarg);
+      break;
+    case 'H':
+      main_state.cache_conf.huge_pages = true;
+      break;
+    case 'z':
+      str_set_compress_min_size(main_state, optarg);
+      break;
+    case 'w':
+      str_set_warm_up(main_state, optarg);
+      break;
     case 'p':
       str_set_port(sconf, optarg);
       break;
@@ -320,6 +550,9 @@ int parse_args(main_t &main_state, server::server_config_t &sconf, int argc,
     case 'd':
       sconf.db_path = optarg;
       break;
+    case 'l':
+      str_set_l1_entries(sconf, optarg);
+      break;
 
     case 'h':
       status = 1;
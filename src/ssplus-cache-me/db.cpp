@@ -1,10 +1,22 @@
 #include "ssplus-cache-me/db.h"
 #include "ssplus-cache-me/debug.h"
 #include "ssplus-cache-me/log.h"
+#include "ssplus-cache-me/near_cache.h"
 #include "ssplus-cache-me/query_runner.h"
 #include "ssplus-cache-me/run.h"
+#include "ssplus-cache-me/util.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <sqlite3.h>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 DECLARE_DEBUG_INFO_DEFAULT();
 
@@ -100,6 +112,17 @@ int prepare_statement(sqlite3 *conn, const char *query, sqlite3_stmt **stmt,
   return status;
 }
 
+void get_stmt_cache_stats(size_t &count, size_t &bytes) noexcept {
+  std::shared_lock lk(stmt_cache_m);
+
+  count = stmt_cache.size();
+  bytes = 0;
+
+  for (const auto &[k, stmt] : stmt_cache)
+    bytes += k.capacity() +
+             sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
+}
+
 void reset_statement(sqlite3_stmt **stmt) noexcept {
   if (*stmt == nullptr)
     return;
@@ -139,78 +162,137 @@ int finalize_statement(const std::string &stmt_key,
   return finalize_statement_unlocked(stmt_key, stmt);
 }
 
-cache::data_t get_cache(sqlite3 *conn, const std::string &key,
+static const char *const get_cache_query =
+    "SELECT \"value\",\"expires_at\",\"codec\",\"version\",\"delta\" "
+    "FROM \"cache\" WHERE \"key\" = ?1 ;";
+
+// bumped by cleanup(), statements threads held on to got finalized
+static std::atomic<uint64_t> stmt_generation = 0;
+
+// get_cache() statement of the server thread, prepared once per conn so a
+// lookup doesn't touch stmt_cache
+struct thread_stmt_t {
+  sqlite3 *conn = nullptr;
+  sqlite3_stmt *stmt = nullptr;
+  uint64_t generation = 0;
+};
+
+static thread_local thread_stmt_t get_cache_stmt;
+
+cache::data_t get_cache(sqlite3 *conn, std::string_view key,
                         int server_id) noexcept {
   cache::data_t ret;
   if (key.empty())
     return ret;
 
-  std::string query =
-      "SELECT \"value\",\"expires_at\" FROM \"cache\" WHERE \"key\" = ?1 ;";
-
-  sqlite3_stmt *statement = nullptr;
-  std::string stmt_cache_key = std::to_string(server_id) + "s";
-  int status =
-      prepare_statement(conn, query.c_str(), &statement, stmt_cache_key);
+  auto &ts = get_cache_stmt;
+  const uint64_t generation = stmt_generation.load(std::memory_order_acquire);
 
+  int status = SQLITE_OK;
   int klen = static_cast<int>(key.length());
-  if (status != SQLITE_OK)
-    goto err;
 
-  status = sqlite3_bind_text(statement, 1, key.c_str(), klen, SQLITE_STATIC);
+  if (!ts.stmt || ts.conn != conn || ts.generation != generation) {
+    // still registered in stmt_cache so cleanup() finalizes it
+    ts.stmt = nullptr;
+    status = prepare_statement(conn, get_cache_query, &ts.stmt,
+                               std::to_string(server_id) + "s");
+
+    if (status != SQLITE_OK)
+      goto err;
+
+    ts.conn = conn;
+    ts.generation = generation;
+  }
+
+  status = sqlite3_bind_text(ts.stmt, 1, key.data(), klen, SQLITE_STATIC);
 
   if (status != SQLITE_OK) {
     log::io() << DEBUG_WHERE << "Failed binding key(" << key
               << ") to query with status(" << status << "):\n"
-              << query << "\n\n";
+              << get_cache_query << "\n\n";
 
     goto err;
   }
 
   // execute statement
-  status = sqlite3_step(statement);
+  status = sqlite3_step(ts.stmt);
   if (status == SQLITE_ROW) {
-    // columns: "value","expires_at"
-    ret.value =
-        reinterpret_cast<const char *>(sqlite3_column_text(statement, 0));
-
-    ret.expires_at = static_cast<uint64_t>(sqlite3_column_int64(statement, 1));
+    // columns: "value","expires_at","codec","version","delta"
+    ret.value = cache::value_t(
+        static_cast<const char *>(sqlite3_column_blob(ts.stmt, 0)),
+        sqlite3_column_bytes(ts.stmt, 0));
+
+    ret.expires_at = static_cast<uint64_t>(sqlite3_column_int64(ts.stmt, 1));
+    ret.codec = static_cast<codec::codec_t>(sqlite3_column_int(ts.stmt, 2));
+    ret.version = static_cast<uint64_t>(sqlite3_column_int64(ts.stmt, 3));
+    ret.delta = static_cast<uint16_t>(sqlite3_column_int(ts.stmt, 4));
   }
 
-  reset_statement(&statement);
+  reset_statement(&ts.stmt);
 
   return ret;
 
 err:
-  finalize_statement(stmt_cache_key, &statement);
+  finalize_statement(std::to_string(server_id) + "s", &ts.stmt);
 
   return ret;
 }
 
-// only servers are allowed to call this
-cache::vector_data_t get_all_cache(sqlite3 *conn, int server_id) noexcept {
-  cache::vector_data_t ret;
+// smallest key filter loaded, in keys
+static constexpr size_t min_key_filter_keys = size_t{1} << 14;
 
-  std::string query = "SELECT \"value\",\"expires_at\" FROM \"cache\";";
+static const char *const get_all_query =
+    "SELECT \"key\",\"value\",\"expires_at\",\"codec\",\"version\","
+    "\"delta\" FROM \"cache\";";
+
+// step statement to the end, collecting every row not already expired
+static int read_all_rows(sqlite3_stmt *statement, cache::all_data_t &out) {
+  const uint64_t now = util::get_current_ts();
+
+  int status;
+  cache::data_t temp;
+
+  while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+    // columns: "key","value","expires_at","codec","version","delta"
+    temp.expires_at = static_cast<uint64_t>(sqlite3_column_int64(statement, 2));
+
+    if (temp.expires_at != 0 && temp.expires_at <= now)
+      continue;
+
+    temp.value = cache::value_t(
+        static_cast<const char *>(sqlite3_column_blob(statement, 1)),
+        sqlite3_column_bytes(statement, 1));
+    temp.codec = static_cast<codec::codec_t>(sqlite3_column_int(statement, 3));
+    temp.version =
+        static_cast<uint64_t>(sqlite3_column_int64(statement, 4));
+    temp.delta = static_cast<uint16_t>(sqlite3_column_int(statement, 5));
+
+    out.set(std::string(
+                reinterpret_cast<const char *>(sqlite3_column_text(statement, 0)),
+                sqlite3_column_bytes(statement, 0)),
+            temp);
+  }
+
+  return status;
+}
+
+// only servers are allowed to call this
+cache::all_data_t get_all_cache(sqlite3 *conn, int server_id) noexcept {
+  cache::all_data_t ret;
 
   sqlite3_stmt *statement = nullptr;
   std::string stmt_cache_key = std::to_string(server_id) + "a";
   int status =
-      prepare_statement(conn, query.c_str(), &statement, stmt_cache_key);
+      prepare_statement(conn, get_all_query, &statement, stmt_cache_key);
 
-  cache::data_t temp;
   if (status != SQLITE_OK)
     goto err;
 
-  // execute statement
-  while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
-    // columns: "value","expires_at"
-    temp.value =
-        reinterpret_cast<const char *>(sqlite3_column_text(statement, 0));
-
-    temp.expires_at = static_cast<uint64_t>(sqlite3_column_int64(statement, 1));
-
-    ret.emplace_back(temp);
+  try {
+    read_all_rows(statement, ret);
+  } catch (std::exception &e) {
+    log::io() << DEBUG_WHERE << e.what() << "\n";
+    ret.clear();
   }
 
   reset_statement(&statement);
@@ -223,60 +305,510 @@ err:
   return ret;
 }
 
-int set_cache(const std::string &key, const cache::data_t &data) noexcept {
-  if (key.empty() || data.empty())
-    return 1;
+int load_all_cache() noexcept {
+  query_schedule_t q("all");
 
-  query_schedule_t q("set/" + key);
+  q.query = get_all_query;
 
-  q.query = "INSERT INTO \"cache\" "
-            "(\"key\", \"value\", \"expires_at\") "
+  q.run = [](sqlite3_stmt **statement, const query_schedule_t &,
+             sqlite3 *conn) -> int {
+    // a second request got queued before the first load ran
+    if (cache::get_all().second)
+      return SQLITE_DONE;
 
-            "VALUES (?1, ?2, ?3) "
+    cache::all_data_t all;
+    int status;
 
-            "ON CONFLICT (\"key\") "
-            "DO UPDATE SET "
+    try {
+      status = read_all_rows(*statement, all);
+    } catch (std::exception &e) {
+      log::io() << DEBUG_WHERE << e.what() << "\n";
+      return SQLITE_ERROR;
+    }
 
-            "\"value\" = ?2, "
-            "\"expires_at\" = ?3 ;";
+    if (status != SQLITE_DONE) {
+      log::io() << DEBUG_WHERE << "Failed loading all cache: "
+                << sqlite3_errmsg(conn) << "\n";
 
-  q.run = [key, data](sqlite3_stmt **statement, const query_schedule_t &q,
-                      sqlite3 *conn) -> int {
-    auto log_bind_fail = [&q, &statement](const std::string &name,
-                                          const std::string &v) {
-      log::io() << DEBUG_WHERE << "Failed binding " << name << "(" << v
-                << ")\n";
+      return status;
+    }
 
-      finalize_statement(q.query, statement);
-    };
+    cache::set_all(std::move(all));
 
-    int klen = static_cast<int>(key.length());
-    int status =
-        sqlite3_bind_text(*statement, 1, key.c_str(), klen, SQLITE_STATIC);
+    return status;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
+// key filter rows only get counted once, see cache::known_absent()
+static const char *const update_cache_query =
+    "UPDATE \"cache\" SET \"value\" = ?2, \"expires_at\" = ?3, "
+    "\"codec\" = ?4, \"version\" = ?5, \"delta\" = ?6 WHERE \"key\" = ?1 ;";
+
+// bind key, value, expires_at, codec, version and delta to ?1 up to ?6
+static int bind_cache_row(sqlite3_stmt **statement, const std::string &query,
+                          const std::string &key,
+                          const cache::data_t &data) noexcept {
+  auto log_bind_fail = [&query, &statement](const std::string &name,
+                                            const std::string &v) {
+    log::io() << DEBUG_WHERE << "Failed binding " << name << "(" << v
+              << ")\n";
+
+    finalize_statement(query, statement);
+  };
+
+  int klen = static_cast<int>(key.length());
+  int status =
+      sqlite3_bind_text(*statement, 1, key.c_str(), klen, SQLITE_STATIC);
+
+  if (status != SQLITE_OK) {
+    log_bind_fail("key", key);
+    return status;
+  }
+
+  // compressed values aren't text
+  int vlen = static_cast<int>(data.value.size());
+  status = data.compressed() ? sqlite3_bind_blob(*statement, 2,
+                                                 data.value.data(), vlen,
+                                                 SQLITE_STATIC)
+                             : sqlite3_bind_text(*statement, 2,
+                                                 data.value.data(), vlen,
+                                                 SQLITE_STATIC);
+
+  if (status != SQLITE_OK) {
+    log_bind_fail("value", data.compressed()
+                               ? std::to_string(vlen) + " compressed bytes"
+                               : data.value.str());
+    return status;
+  }
+
+  status = sqlite3_bind_int64(*statement, 3,
+                              static_cast<int64_t>(data.get_expires_at()));
+
+  if (status != SQLITE_OK) {
+    log_bind_fail("expires_at", std::to_string(data.get_expires_at()));
+    return status;
+  }
+
+  status = sqlite3_bind_int(*statement, 4, data.codec);
+
+  if (status != SQLITE_OK) {
+    log_bind_fail("codec", std::to_string(data.codec));
+    return status;
+  }
+
+  status = sqlite3_bind_int64(*statement, 5,
+                              static_cast<int64_t>(data.version));
+
+  if (status != SQLITE_OK) {
+    log_bind_fail("version", std::to_string(data.version));
+    return status;
+  }
+
+  status = sqlite3_bind_int(*statement, 6, data.delta);
+
+  if (status != SQLITE_OK) {
+    log_bind_fail("delta", std::to_string(data.delta));
+    return status;
+  }
+
+  return status;
+}
+
+// run a statement beside the one of q, through the statement cache, with
+// texts bound to ?1, ?2, ... in order. A busy db reschedules q as a whole
+static int run_with_texts(sqlite3 *conn, const query_schedule_t &q,
+                          const char *query,
+                          std::initializer_list<std::string_view> texts) {
+  sqlite3_stmt *statement = nullptr;
+
+  int status = prepare_statement(conn, query, &statement);
+  if (status != SQLITE_OK)
+    return status;
+
+  int i = 1;
+  for (auto t : texts) {
+    status = sqlite3_bind_text(statement, i, t.data(),
+                               static_cast<int>(t.size()), SQLITE_STATIC);
 
     if (status != SQLITE_OK) {
-      log_bind_fail("key", key);
+      log::io() << DEBUG_WHERE << "Failed binding ?" << i << "(" << t
+                << ") to query with status(" << status << "):\n"
+                << query << "\n\n";
+
+      finalize_statement(query, &statement);
       return status;
     }
 
-    int vlen = static_cast<int>(data.value.length());
-    status = sqlite3_bind_text(*statement, 2, data.value.c_str(), vlen,
-                               SQLITE_STATIC);
+    i++;
+  }
 
-    if (status != SQLITE_OK) {
-      log_bind_fail("value", data.value);
-      return status;
+  status = query_runner::run_until_done(statement, q, conn);
+  reset_statement(&statement);
+
+  return status;
+}
+
+static const char *const delete_tags_query =
+    "DELETE FROM \"cache_tags\" WHERE \"key\" = ?1 ;";
+
+// every tag of key is replaced by tags
+static int replace_tags(sqlite3 *conn, const query_schedule_t &q,
+                        const std::string &key,
+                        const std::vector<std::string> &tags) {
+  static const char *const insert_tag_query =
+      "INSERT OR IGNORE INTO \"cache_tags\" (\"tag\", \"key\") "
+      "VALUES (?1, ?2) ;";
+
+  int status = SQLITE_DONE;
+
+  if (cache::has_tags(key))
+    status = run_with_texts(conn, q, delete_tags_query, {key});
+
+  for (size_t i = 0; i < tags.size() && status == SQLITE_DONE; i++)
+    status = run_with_texts(conn, q, insert_tag_query, {tags[i], key});
+
+  if (status == SQLITE_DONE)
+    cache::mark_tagged(key, tags);
+
+  return status;
+}
+
+int load_key_filter() noexcept {
+  query_schedule_t q("keys");
+
+  // in order so the index fills its leaves as it goes
+  q.query = "SELECT \"key\" FROM \"cache\" ORDER BY \"key\";";
+
+  q.run = [](sqlite3_stmt **statement, const query_schedule_t &,
+             sqlite3 *conn) -> int {
+    std::vector<size_t> hashes;
+    auto index = std::make_unique<cache::key_index_t>();
+    int status;
+
+    try {
+      while ((status = sqlite3_step(*statement)) == SQLITE_ROW) {
+        const std::string_view key(
+            reinterpret_cast<const char *>(sqlite3_column_text(*statement, 0)),
+            sqlite3_column_bytes(*statement, 0));
+
+        hashes.push_back(cache::key_hash(key));
+        index->insert(key);
+      }
+
+      if (status != SQLITE_DONE) {
+        log::io() << DEBUG_WHERE << "Failed loading key filter: "
+                  << sqlite3_errmsg(conn) << "\n";
+
+        return status;
+      }
+
+      // room to grow before the next rebuild
+      auto f = std::make_unique<cache::key_filter_t>(
+          std::max(hashes.size() * 2, min_key_filter_keys));
+
+      for (size_t h : hashes)
+        f->add(h);
+
+      log::io() << "Key filter and index loaded with " << hashes.size()
+                << " key(s)\n";
+
+      cache::set_key_filter(std::move(f));
+      cache::set_key_index(std::move(index));
+    } catch (std::exception &e) {
+      log::io() << DEBUG_WHERE << e.what() << "\n";
+      return SQLITE_ERROR;
     }
 
-    status = sqlite3_bind_int64(*statement, 3,
-                                static_cast<int64_t>(data.get_expires_at()));
+    return status;
+  };
 
-    if (status != SQLITE_OK) {
-      log_bind_fail("expires_at", std::to_string(data.get_expires_at()));
+  enqueue_write_query(q);
+
+  return 0;
+}
+
+// rowids scanned per statement, keeps each read lock short so the db
+// writer doesn't get busy waiting on it
+static constexpr uint64_t warm_up_span = 4096;
+
+struct warm_up_t {
+  std::string path;
+
+  int64_t first_rowid;
+  int64_t last_rowid;
+  uint64_t chunks;
+  std::atomic<uint64_t> next_chunk = 0;
+
+  // threads not done yet
+  std::atomic<int> running;
+  std::chrono::steady_clock::time_point start;
+};
+
+static std::vector<std::thread> warm_up_threads;
+static std::atomic<bool> warm_done = false;
+static std::atomic<size_t> warm_rows = 0;
+
+static void warm_up_finish(warm_up_t &w, int threads) {
+  if (w.running.fetch_sub(threads, std::memory_order_acq_rel) != threads)
+    return;
+
+  log::io() << "Memory cache warmed up with "
+            << warm_rows.load(std::memory_order_relaxed) << " row(s) in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - w.start)
+                   .count()
+            << "ms\n";
+
+  warm_done.store(true, std::memory_order_release);
+}
+
+static void warm_up_routine(std::shared_ptr<warm_up_t> w) {
+  static const char *const query =
+      "SELECT \"key\",\"value\",\"expires_at\",\"codec\",\"version\","
+      "\"delta\" FROM \"cache\" WHERE rowid BETWEEN ?1 AND ?2 "
+      "AND (\"expires_at\" = 0 OR \"expires_at\" > ?3) ;";
+
+  const size_t max_memory = get_main_state()->cache_conf.max_memory;
+
+  sqlite3 *conn = nullptr;
+  sqlite3_stmt *statement = nullptr;
+
+  int status = init(w->path.c_str(), &conn);
+
+  if (status == SQLITE_OK &&
+      (status = sqlite3_prepare_v2(conn, query, -1, &statement, NULL)) !=
+          SQLITE_OK)
+    log::io() << DEBUG_WHERE << "Error preparing statement with status("
+              << status << "): " << sqlite3_errmsg(conn) << "\n";
+
+  std::vector<std::pair<std::string, cache::data_t>> rows;
+
+  while (status == SQLITE_OK && get_main_state()->running) {
+    const uint64_t chunk =
+        w->next_chunk.fetch_add(1, std::memory_order_relaxed);
+    if (chunk >= w->chunks)
+      break;
+
+    const int64_t from = w->first_rowid + chunk * warm_up_span;
+    const int64_t to =
+        static_cast<uint64_t>(w->last_rowid) - static_cast<uint64_t>(from) <
+                warm_up_span
+            ? w->last_rowid
+            : from + static_cast<int64_t>(warm_up_span - 1);
+
+    sqlite3_bind_int64(statement, 1, from);
+    sqlite3_bind_int64(statement, 2, to);
+    sqlite3_bind_int64(statement, 3,
+                       static_cast<int64_t>(util::get_current_ts()));
+
+    try {
+      const auto marks = cache::delete_marks();
+
+      while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+        // columns: "key","value","expires_at","codec","version","delta"
+        cache::data_t temp;
+        temp.value = cache::value_t(
+            static_cast<const char *>(sqlite3_column_blob(statement, 1)),
+            sqlite3_column_bytes(statement, 1));
+        temp.expires_at =
+            static_cast<uint64_t>(sqlite3_column_int64(statement, 2));
+        temp.codec =
+            static_cast<codec::codec_t>(sqlite3_column_int(statement, 3));
+        temp.version =
+            static_cast<uint64_t>(sqlite3_column_int64(statement, 4));
+        temp.delta =
+            static_cast<uint16_t>(sqlite3_column_int(statement, 5));
+
+        rows.emplace_back(
+            std::string(reinterpret_cast<const char *>(
+                            sqlite3_column_text(statement, 0)),
+                        sqlite3_column_bytes(statement, 0)),
+            std::move(temp));
+      }
+
+      warm_rows.fetch_add(cache::warm(rows, marks), std::memory_order_relaxed);
+    } catch (std::exception &e) {
+      log::io() << DEBUG_WHERE << e.what() << "\n";
+      status = SQLITE_NOMEM;
+    }
+
+    rows.clear();
+    reset_statement(&statement);
+
+    if (status != SQLITE_DONE) {
+      log::io() << DEBUG_WHERE << "Failed warming up rowid(" << from
+                << ") onward: " << sqlite3_errmsg(conn) << "\n";
+      break;
+    }
+
+    status = SQLITE_OK;
+
+    // anything more would only be evicted
+    if (max_memory && cache::memory_usage() >= max_memory) {
+      log::io() << "Memory cache is full, stopping warm up\n";
+      w->next_chunk.store(w->chunks, std::memory_order_relaxed);
+      break;
+    }
+  }
+
+  if (statement)
+    sqlite3_finalize(statement);
+
+  if (conn)
+    close(&conn);
+
+  warm_up_finish(*w, 1);
+}
+
+int warm_up(const std::string &path, int threads) noexcept {
+  if (threads <= 0) {
+    warm_done.store(true, std::memory_order_release);
+    return 0;
+  }
+
+  query_schedule_t q("warm_up");
+
+  q.query = "SELECT MIN(rowid), MAX(rowid) FROM \"cache\";";
+
+  q.run = [path, threads](sqlite3_stmt **statement, const query_schedule_t &q,
+                          sqlite3 *conn) -> int {
+    int status = sqlite3_step(*statement);
+    const bool empty = sqlite3_column_type(*statement, 0) == SQLITE_NULL;
+    const int64_t first = sqlite3_column_int64(*statement, 0);
+    const int64_t last = sqlite3_column_int64(*statement, 1);
+
+    // this statement only run once on boot so delete it immediately
+    finalize_statement(q.query, statement);
+
+    if (status != SQLITE_ROW || empty) {
+      if (status != SQLITE_ROW)
+        log::io() << DEBUG_WHERE << "Failed reading rowid range: "
+                  << sqlite3_errmsg(conn) << "\n";
+
+      warm_done.store(true, std::memory_order_release);
+      return status == SQLITE_ROW ? SQLITE_DONE : status;
+    }
+
+    auto w = std::make_shared<warm_up_t>();
+    w->path = path;
+    w->first_rowid = first;
+    w->last_rowid = last;
+    w->chunks =
+        (static_cast<uint64_t>(last) - static_cast<uint64_t>(first)) /
+            warm_up_span +
+        1;
+    w->start = std::chrono::steady_clock::now();
+
+    const int n = static_cast<int>(
+        std::min(static_cast<uint64_t>(threads), w->chunks));
+    w->running.store(n, std::memory_order_relaxed);
+
+    log::io() << "Warming up memory cache on " << n << " thread(s)\n";
+
+    for (int i = 0; i < n; i++) {
+      try {
+        warm_up_threads.emplace_back(warm_up_routine, w);
+      } catch (std::exception &e) {
+        log::io() << DEBUG_WHERE << e.what() << "\n";
+        warm_up_finish(*w, n - i);
+        break;
+      }
+    }
+
+    return SQLITE_DONE;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
+bool warm() noexcept { return warm_done.load(std::memory_order_acquire); }
+
+size_t warmed_rows() noexcept {
+  return warm_rows.load(std::memory_order_relaxed);
+}
+
+static const char *const insert_cache_query =
+    "INSERT OR IGNORE INTO \"cache\" "
+    "(\"key\", \"value\", \"expires_at\", \"codec\", \"version\", "
+    "\"delta\") VALUES (?1, ?2, ?3, ?4, ?5, ?6) ;";
+
+// insert or update the row of key with statement of insert_cache_query.
+// inserted is whether the row is new
+static int write_cache_row(sqlite3_stmt **statement, const query_schedule_t &q,
+                           sqlite3 *conn, const std::string &key,
+                           const cache::data_t &data, bool &inserted) {
+  int status = bind_cache_row(statement, q.query, key, data);
+  if (status != SQLITE_OK)
+    return status;
+
+  status = query_runner::run_until_done(*statement, q, conn);
+  if (status != SQLITE_DONE)
+    return status;
+
+  // the row already exists otherwise
+  inserted = sqlite3_changes(conn) > 0;
+
+  if (!inserted) {
+    sqlite3_stmt *update = nullptr;
+
+    status = prepare_statement(conn, update_cache_query, &update);
+    if (status != SQLITE_OK)
+      return status;
+
+    status = bind_cache_row(&update, update_cache_query, key, data);
+    if (status != SQLITE_OK)
       return status;
+
+    // a busy db reschedules the whole query, the insert is a no-op then
+    status = query_runner::run_until_done(update, q, conn);
+    reset_statement(&update);
+  }
+
+  return status;
+}
+
+int set_cache(const std::string &key, const cache::data_t &data,
+              const std::vector<std::string> &tags) noexcept {
+  if (key.empty() || data.empty())
+    return 1;
+
+  query_schedule_t q("set/" + key);
+  q.payload_bytes = key.capacity() + data.value.memory_usage();
+
+  for (const auto &t : tags)
+    q.payload_bytes += sizeof(t) + t.capacity();
+
+  q.query = insert_cache_query;
+
+  q.run = [key, data, tags](sqlite3_stmt **statement,
+                            const query_schedule_t &q,
+                            sqlite3 *conn) -> int {
+    bool inserted = false;
+
+    int status = write_cache_row(statement, q, conn, key, data, inserted);
+    if (status != SQLITE_DONE)
+      return status;
+
+    // every set replaces the tags, only keys tagged before need a delete
+    if (!tags.empty() || cache::has_tags(key)) {
+      status = replace_tags(conn, q, key, tags);
+      if (status != SQLITE_DONE)
+        return status;
     }
 
-    return query_runner::run_until_done(*statement, q, conn);
+    // safe to drop from memory now
+    cache::mark_persisted(key, data, inserted);
+
+    if (inserted && cache::key_filter_full())
+      load_key_filter();
+
+    return status;
   };
 
   enqueue_write_query(q);
@@ -293,18 +825,75 @@ int set_cache(const std::string &key, const cache::data_t &data) noexcept {
   return 0;
 }
 
+// keys with a flush_counter() queued, so increments meanwhile don't queue
+// another or push it back
+static std::mutex counters_m;
+static std::unordered_set<std::string> counters_queued;
+
+int flush_counter(const std::string &key, uint64_t delay_ms) noexcept {
+  if (key.empty())
+    return 1;
+
+  try {
+    std::lock_guard lk(counters_m);
+    if (!counters_queued.insert(key).second)
+      return 0;
+  } catch (...) {
+    return 1;
+  }
+
+  query_schedule_t q("cnt/" + key);
+  q.payload_bytes = key.capacity();
+  q.ts = util::get_current_ts() + delay_ms;
+
+  q.query = insert_cache_query;
+
+  q.run = [key](sqlite3_stmt **statement, const query_schedule_t &q,
+                sqlite3 *conn) -> int {
+    {
+      // increments from here on queue the next flush
+      std::lock_guard lk(counters_m);
+      counters_queued.erase(key);
+    }
+
+    // nothing to write once it got persisted by a set, deleted or expired
+    cache::data_t data;
+    if (!cache::get_unpersisted(key, data))
+      return SQLITE_DONE;
+
+    bool inserted = false;
+
+    // tags are left as the last set left them
+    int status = write_cache_row(statement, q, conn, key, data, inserted);
+    if (status != SQLITE_DONE)
+      return status;
+
+    cache::mark_persisted(key, data, inserted);
+
+    if (inserted && cache::key_filter_full())
+      load_key_filter();
+
+    return status;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
 int delete_cache(const std::string &key, uint64_t at) noexcept {
   if (key.empty())
     return 1;
 
   query_schedule_t q("del/" + key);
+  q.payload_bytes = key.capacity();
 
   q.query = "DELETE FROM \"cache\" WHERE \"key\" = ?1 ;";
 
   q.run = [key](sqlite3_stmt **statement, const query_schedule_t &q,
                 sqlite3 *conn) -> int {
-    cache::del(key);
-
+    // memory entries are expired by the cache itself, the DELETE endpoint
+    // drops them before enqueueing this
     int klen = static_cast<int>(key.length());
     int status =
         sqlite3_bind_text(*statement, 1, key.c_str(), klen, SQLITE_STATIC);
@@ -316,7 +905,25 @@ int delete_cache(const std::string &key, uint64_t at) noexcept {
       return status;
     }
 
-    return query_runner::run_until_done(*statement, q, conn);
+    status = query_runner::run_until_done(*statement, q, conn);
+
+    if (status != SQLITE_DONE || sqlite3_changes(conn) == 0)
+      return status;
+
+    if (cache::has_tags(key)) {
+      status = run_with_texts(conn, q, delete_tags_query, {key});
+      if (status != SQLITE_DONE)
+        return status;
+    }
+
+    cache::mark_deleted(key);
+
+    // a get between the delete request and now could have loaded the row
+    // back into memory as persisted
+    cache::del_persisted(key);
+    cache::invalidate_near(key);
+
+    return status;
   };
 
   q.ts = at;
@@ -328,7 +935,272 @@ int delete_cache(const std::string &key, uint64_t at) noexcept {
   return 0;
 }
 
+// the smallest string sorting after every string starting with prefix,
+// empty when there's none (prefix is all 0xff)
+static std::string prefix_end(std::string_view prefix) {
+  std::string ret(prefix);
+
+  while (!ret.empty()) {
+    auto &c = reinterpret_cast<unsigned char &>(ret.back());
+    if (c != 0xff) {
+      c++;
+      return ret;
+    }
+
+    ret.pop_back();
+  }
+
+  return ret;
+}
+
+int delete_prefix(const std::string &prefix) noexcept {
+  if (prefix.empty())
+    return 1;
+
+  std::string end;
+
+  try {
+    end = prefix_end(prefix);
+  } catch (std::exception &e) {
+    log::io() << DEBUG_WHERE << e.what() << "\n";
+    return 2;
+  }
+
+  query_schedule_t q("delp/" + prefix);
+  q.payload_bytes = prefix.capacity() + end.capacity();
+
+  // key is the primary key, both bounds are a range over its index
+  q.query = end.empty()
+                ? "DELETE FROM \"cache\" WHERE \"key\" >= ?1 ;"
+                : "DELETE FROM \"cache\" WHERE \"key\" >= ?1 "
+                  "AND \"key\" < ?2 ;";
+
+  q.run = [prefix, end](sqlite3_stmt **statement, const query_schedule_t &q,
+                        sqlite3 *conn) -> int {
+    int status = sqlite3_bind_text(*statement, 1, prefix.c_str(),
+                                   static_cast<int>(prefix.length()),
+                                   SQLITE_STATIC);
+
+    if (status == SQLITE_OK && !end.empty())
+      status = sqlite3_bind_text(*statement, 2, end.c_str(),
+                                 static_cast<int>(end.length()),
+                                 SQLITE_STATIC);
+
+    if (status != SQLITE_OK) {
+      log::io() << DEBUG_WHERE << "Failed binding prefix(" << prefix
+                << ")\n";
+
+      finalize_statement(q.query, statement);
+      return status;
+    }
+
+    // the index matches db here, it's only patched by this thread. Taken
+    // before the rows are gone, a busy db reschedules this whole query
+    std::vector<std::string> keys;
+
+    try {
+      keys = cache::list_keys(prefix, "", SIZE_MAX);
+    } catch (std::exception &e) {
+      log::io() << DEBUG_WHERE << e.what() << "\n";
+      return SQLITE_NOMEM;
+    }
+
+    status = query_runner::run_until_done(*statement, q, conn);
+    if (status != SQLITE_DONE)
+      return status;
+
+    log::io() << "Deleted " << sqlite3_changes(conn)
+              << " row(s) with prefix(" << prefix << ")\n";
+
+    if (std::any_of(keys.begin(), keys.end(), cache::has_tags)) {
+      status = end.empty()
+                   ? run_with_texts(conn, q,
+                                    "DELETE FROM \"cache_tags\" "
+                                    "WHERE \"key\" >= ?1 ;",
+                                    {prefix})
+                   : run_with_texts(conn, q,
+                                    "DELETE FROM \"cache_tags\" "
+                                    "WHERE \"key\" >= ?1 AND \"key\" < ?2 ;",
+                                    {prefix, end});
+
+      if (status != SQLITE_DONE)
+        return status;
+    }
+
+    // gets since the delete request could have loaded rows back into
+    // memory as persisted
+    for (const auto &k : keys) {
+      cache::mark_deleted(k);
+      cache::del_persisted(k);
+    }
+
+    cache::invalidate_near(prefix, true);
+
+    return status;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
+int delete_tag(const std::string &tag) noexcept {
+  if (tag.empty())
+    return 1;
+
+  query_schedule_t q("delt/" + tag);
+  q.payload_bytes = tag.capacity();
+
+  q.query = "DELETE FROM \"cache\" WHERE \"key\" IN "
+            "(SELECT \"key\" FROM \"cache_tags\" WHERE \"tag\" = ?1) ;";
+
+  q.run = [tag](sqlite3_stmt **statement, const query_schedule_t &q,
+                sqlite3 *conn) -> int {
+    int status = sqlite3_bind_text(*statement, 1, tag.c_str(),
+                                   static_cast<int>(tag.length()),
+                                   SQLITE_STATIC);
+
+    if (status != SQLITE_OK) {
+      log::io() << DEBUG_WHERE << "Failed binding tag(" << tag << ")\n";
+
+      finalize_statement(q.query, statement);
+      return status;
+    }
+
+    // the index matches db here, see delete_prefix()
+    std::vector<std::string> keys;
+
+    try {
+      keys = cache::tagged_keys(tag);
+    } catch (std::exception &e) {
+      log::io() << DEBUG_WHERE << e.what() << "\n";
+      return SQLITE_NOMEM;
+    }
+
+    status = query_runner::run_until_done(*statement, q, conn);
+    if (status != SQLITE_DONE)
+      return status;
+
+    log::io() << "Deleted " << sqlite3_changes(conn) << " row(s) with tag("
+              << tag << ")\n";
+
+    // every tag of those keys, not only this one
+    status = run_with_texts(
+        conn, q,
+        "DELETE FROM \"cache_tags\" WHERE \"key\" IN "
+        "(SELECT \"key\" FROM \"cache_tags\" WHERE \"tag\" = ?1) ;",
+        {tag});
+
+    if (status != SQLITE_DONE)
+      return status;
+
+    // the endpoint dropped them from memory already, except the ones set
+    // since the last query ran. Anything set again after stays dirty
+    for (const auto &k : keys) {
+      cache::mark_deleted(k);
+      cache::del_persisted(k);
+      cache::invalidate_near(k);
+    }
+
+    return status;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
+int load_tags() noexcept {
+  query_schedule_t q("tags");
+
+  q.query = "SELECT \"tag\",\"key\" FROM \"cache_tags\";";
+
+  q.run = [](sqlite3_stmt **statement, const query_schedule_t &q,
+             sqlite3 *conn) -> int {
+    auto index = std::make_unique<cache::tag_index_t>();
+    int status;
+
+    try {
+      std::string tag, key;
+
+      while ((status = sqlite3_step(*statement)) == SQLITE_ROW) {
+        tag.assign(
+            reinterpret_cast<const char *>(sqlite3_column_text(*statement, 0)),
+            sqlite3_column_bytes(*statement, 0));
+        key.assign(
+            reinterpret_cast<const char *>(sqlite3_column_text(*statement, 1)),
+            sqlite3_column_bytes(*statement, 1));
+
+        index->add(key, tag);
+      }
+    } catch (std::exception &e) {
+      log::io() << DEBUG_WHERE << e.what() << "\n";
+      status = SQLITE_NOMEM;
+    }
+
+    // this statement only run once on boot so delete it immediately
+    finalize_statement(q.query, statement);
+
+    if (status != SQLITE_DONE) {
+      log::io() << DEBUG_WHERE << "Failed loading tags: "
+                << sqlite3_errmsg(conn) << "\n";
+
+      return status;
+    }
+
+    log::io() << "Tag index loaded with " << index->tag_count()
+              << " tag(s) over " << index->size() << " key(s)\n";
+
+    cache::set_tag_index(std::move(index));
+
+    return status;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
+int load_max_version() noexcept {
+  query_schedule_t q("max_version");
+
+  q.query = "SELECT MAX(\"version\") FROM \"cache\";";
+
+  q.run = [](sqlite3_stmt **statement, const query_schedule_t &q,
+             sqlite3 *conn) -> int {
+    int status = sqlite3_step(*statement);
+    const uint64_t max =
+        status == SQLITE_ROW
+            ? static_cast<uint64_t>(sqlite3_column_int64(*statement, 0))
+            : 0;
+
+    // this statement only run once on boot so delete it immediately
+    finalize_statement(q.query, statement);
+
+    if (status != SQLITE_ROW) {
+      log::io() << DEBUG_WHERE << "Failed reading max version: "
+                << sqlite3_errmsg(conn) << "\n";
+      return status;
+    }
+
+    cache::observe_version(max);
+
+    return SQLITE_DONE;
+  };
+
+  enqueue_write_query(q);
+
+  return 0;
+}
+
 int cleanup() noexcept {
+  stmt_generation.fetch_add(1, std::memory_order_acq_rel);
+
+  // they stop at the next chunk once main_state isn't running
+  for (auto &t : warm_up_threads)
+    t.join();
+  warm_up_threads.clear();
+
   std::lock_guard lk(stmt_cache_m);
 
   auto i = stmt_cache.begin();
@@ -12,14 +12,23 @@ void get_ts(char *o) {
 
   const int milli = curtime_ms.time_since_epoch().count() % 1000'000;
 
-  char tbuf[128] = "";
-  strftime(tbuf, sizeof(tbuf), "%FT%T",
+  // the date part only changes once a second, formatting it takes the
+  // timezone lock
+  static thread_local time_t last_time = -1;
+  static thread_local char tbuf[128] = "";
+
+  if (curtime != last_time) {
+    struct tm tmbuf;
+    strftime(tbuf, sizeof(tbuf), "%FT%T",
 #ifdef FORCE_LOG_TS_UTC
-           std::gmtime
+             gmtime_r
 #else
-           std::localtime
+             localtime_r
 #endif // FORCE_LOG_TS_UTC
-           (&curtime));
+             (&curtime, &tmbuf));
+
+    last_time = curtime;
+  }
 
   sprintf(o,
           "%s.%06d"
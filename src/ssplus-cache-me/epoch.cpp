@@ -0,0 +1,314 @@
+#include "ssplus-cache-me/epoch.h"
+#include "ssplus-cache-me/debug.h"
+#include "ssplus-cache-me/log.h"
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+DECLARE_DEBUG_INFO_DEFAULT();
+
+namespace ssplus_cache_me::epoch {
+
+// retired entries a thread collects before it tries to free them on its own
+static constexpr size_t reclaim_threshold = 64;
+// a single retire of at least this many bytes (eg. a replaced hash table)
+// doesn't wait for the count
+static constexpr size_t reclaim_bytes = size_t{64} << 10;
+// quiescent() calls between attempts at freeing a short retired list
+static constexpr unsigned reclaim_passes = 64;
+
+struct alignas(64) record_t {
+  // global epoch the thread went online at, 0 while offline
+  std::atomic<uint64_t> epoch = 0;
+  // size of the owning thread's retired list
+  std::atomic<size_t> pending = 0;
+  // and the sum of their n
+  std::atomic<size_t> pending_bytes = 0;
+  std::atomic<bool> in_use = false;
+  record_t *next = nullptr;
+};
+
+struct retired_t {
+  void *p;
+  size_t n;
+  free_fn_t fn;
+  uint64_t epoch;
+};
+
+using retired_list_t = std::vector<retired_t>;
+
+// starts at 1 so 0 can mark a thread offline
+static std::atomic<uint64_t> global_epoch = 1;
+
+// one per thread that ever read or retired, only pushed to and never freed,
+// records of exited threads get reused
+static std::atomic<record_t *> records = nullptr;
+
+// retired by threads that exited before it was safe to free. Never
+// destroyed, the cache still retires during static destruction
+struct orphans_t {
+  std::mutex m;
+  retired_list_t list;
+};
+
+static orphans_t &orphans = *new orphans_t;
+static std::atomic<size_t> orphan_count = 0;
+static std::atomic<size_t> orphan_bytes = 0;
+
+// trivially destructible so retire() during static destruction can still
+// check it after the thread's flusher ran
+struct local_t {
+  record_t *rec;
+  retired_list_t *retired;
+  // sum of n in retired
+  size_t retired_bytes;
+  size_t next_reclaim;
+  unsigned passes;
+  int depth;
+  bool loop;
+  bool closed;
+};
+
+static thread_local local_t local = {
+    nullptr, nullptr, 0, reclaim_threshold, 0, 0, false, false};
+
+static void add_orphans(const retired_t *first, size_t n) noexcept {
+  try {
+    std::lock_guard lk(orphans.m);
+    orphans.list.insert(orphans.list.end(), first, first + n);
+    orphan_count.store(orphans.list.size(), std::memory_order_relaxed);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++)
+      bytes += first[i].n;
+    orphan_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  } catch (std::exception &e) {
+    log::io() << DEBUG_WHERE << e.what() << ", leaking " << n
+              << " retired object(s)\n";
+  }
+}
+
+// hands what's still retired over to the orphans and gives the record back
+// when the thread exits
+struct flusher_t {
+  bool armed = false;
+
+  ~flusher_t() {
+    if (local.retired) {
+      if (!local.retired->empty())
+        add_orphans(local.retired->data(), local.retired->size());
+
+      delete local.retired;
+      local.retired = nullptr;
+      local.retired_bytes = 0;
+    }
+
+    if (local.rec) {
+      local.rec->epoch.store(0, std::memory_order_release);
+      local.rec->pending.store(0, std::memory_order_relaxed);
+      local.rec->pending_bytes.store(0, std::memory_order_relaxed);
+      local.rec->in_use.store(false, std::memory_order_release);
+      local.rec = nullptr;
+    }
+
+    local.closed = true;
+  }
+};
+
+static thread_local flusher_t flusher;
+
+static record_t *get_record() {
+  if (local.rec)
+    return local.rec;
+
+  // a thread already past its flusher keeps the record for good
+  if (!local.closed)
+    flusher.armed = true;
+
+  for (auto *r = records.load(std::memory_order_acquire); r; r = r->next) {
+    bool expected = false;
+
+    if (!r->in_use.load(std::memory_order_relaxed) &&
+        r->in_use.compare_exchange_strong(expected, true,
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed))
+      return local.rec = r;
+  }
+
+  auto *r = new record_t;
+  r->in_use.store(true, std::memory_order_relaxed);
+  r->next = records.load(std::memory_order_relaxed);
+
+  while (!records.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                        std::memory_order_relaxed))
+    ;
+
+  return local.rec = r;
+}
+
+// oldest epoch a thread is online at, bound when they're all newer
+static uint64_t min_online_epoch(uint64_t bound) noexcept {
+  for (auto *r = records.load(std::memory_order_acquire); r; r = r->next) {
+    const uint64_t e = r->epoch.load(std::memory_order_relaxed);
+    if (e != 0 && e < bound)
+      bound = e;
+  }
+
+  return bound;
+}
+
+// free everything in list retired before the oldest online thread's epoch,
+// returns the bytes still retired
+static size_t reclaim(retired_list_t &list) noexcept {
+  if (list.empty())
+    return 0;
+
+  // anything retired in the current epoch can only become safe once the
+  // epoch moves on
+  uint64_t g = global_epoch.load(std::memory_order_relaxed);
+  for (auto &r : list) {
+    if (r.epoch >= g) {
+      g = global_epoch.fetch_add(1, std::memory_order_relaxed) + 1;
+      break;
+    }
+  }
+
+  // pairs with the fence of a reader going online
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const uint64_t safe = min_online_epoch(g);
+
+  size_t kept = 0;
+  size_t ret = 0;
+  for (size_t i = 0; i < list.size(); i++) {
+    if (list[i].epoch < safe) {
+      list[i].fn(list[i].p, list[i].n);
+    } else {
+      ret += list[i].n;
+      list[kept++] = list[i];
+    }
+  }
+
+  list.resize(kept);
+  return ret;
+}
+
+void register_thread() noexcept { local.loop = true; }
+
+void unregister_thread() noexcept {
+  local.loop = false;
+
+  if (local.rec && local.depth == 0)
+    local.rec->epoch.store(0, std::memory_order_release);
+}
+
+void quiescent() noexcept {
+  if (local.rec) {
+    local.rec->epoch.store(0, std::memory_order_release);
+
+    auto *list = local.retired;
+    if (list && !list->empty() &&
+        (list->size() >= reclaim_threshold ||
+         local.retired_bytes >= reclaim_bytes ||
+         ++local.passes % reclaim_passes == 0)) {
+      local.retired_bytes = reclaim(*list);
+      local.rec->pending.store(list->size(), std::memory_order_relaxed);
+      local.rec->pending_bytes.store(local.retired_bytes,
+                                     std::memory_order_relaxed);
+    }
+  }
+
+  if (orphan_count.load(std::memory_order_relaxed) == 0)
+    return;
+
+  std::unique_lock lk(orphans.m, std::try_to_lock);
+  if (!lk)
+    return;
+
+  orphan_bytes.store(reclaim(orphans.list), std::memory_order_relaxed);
+  orphan_count.store(orphans.list.size(), std::memory_order_relaxed);
+}
+
+read_guard_t::read_guard_t() {
+  record_t *rec = get_record();
+
+  if (local.depth++ > 0)
+    return;
+
+  // a loop thread stays online until its next quiescent state
+  if (rec->epoch.load(std::memory_order_relaxed) != 0)
+    return;
+
+  rec->epoch.store(global_epoch.load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+
+  // being online has to be visible before anything gets read, pairs with
+  // the fence in retire()
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+read_guard_t::~read_guard_t() {
+  if (--local.depth > 0 || local.loop)
+    return;
+
+  local.rec->epoch.store(0, std::memory_order_release);
+}
+
+void retire(void *p, size_t n, free_fn_t fn) noexcept {
+  // p is unreachable by now, make sure that's ordered before reading the
+  // epoch it's retired at
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const retired_t r = {p, n, fn, global_epoch.load(std::memory_order_relaxed)};
+
+  if (local.closed)
+    return add_orphans(&r, 1);
+
+  record_t *rec;
+  try {
+    rec = get_record();
+
+    if (!local.retired)
+      local.retired = new retired_list_t;
+
+    local.retired->push_back(r);
+  } catch (std::exception &e) {
+    log::io() << DEBUG_WHERE << e.what() << ", leaking retired object\n";
+    return;
+  }
+
+  auto &list = *local.retired;
+  local.retired_bytes += n;
+
+  if (list.size() >= local.next_reclaim || n >= reclaim_bytes) {
+    local.retired_bytes = reclaim(list);
+
+    // still mostly unsafe, don't rescan on every retire
+    local.next_reclaim = list.size() * 2 > reclaim_threshold
+                             ? list.size() * 2
+                             : reclaim_threshold;
+  }
+
+  rec->pending.store(list.size(), std::memory_order_relaxed);
+  rec->pending_bytes.store(local.retired_bytes, std::memory_order_relaxed);
+}
+
+size_t get_pending_count() noexcept {
+  size_t ret = orphan_count.load(std::memory_order_relaxed);
+
+  for (auto *r = records.load(std::memory_order_acquire); r; r = r->next)
+    ret += r->pending.load(std::memory_order_relaxed);
+
+  return ret;
+}
+
+size_t get_pending_bytes() noexcept {
+  size_t ret = orphan_bytes.load(std::memory_order_relaxed);
+
+  for (auto *r = records.load(std::memory_order_acquire); r; r = r->next)
+    ret += r->pending_bytes.load(std::memory_order_relaxed);
+
+  return ret;
+}
+
+} // namespace ssplus_cache_me::epoch
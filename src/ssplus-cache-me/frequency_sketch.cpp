@@ -0,0 +1,122 @@
+#include "ssplus-cache-me/frequency_sketch.h"
+#include "ssplus-cache-me/epoch.h"
+#include "ssplus-cache-me/util.h"
+
+namespace ssplus_cache_me::cache {
+
+static constexpr uint64_t seeds[4] = {
+    0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull, 0x9ae16a3b2f90404full,
+    0xcbf29ce484222325ull};
+
+frequency_sketch_t::frequency_sketch_t() : table(nullptr), additions(0) {
+  ensure_capacity(64);
+}
+
+frequency_sketch_t::~frequency_sketch_t() {
+  delete table.load(std::memory_order_relaxed);
+}
+
+void frequency_sketch_t::ensure_capacity(size_t max_entries) {
+  size_t words = 1;
+  while (words < max_entries)
+    words <<= 1;
+
+  table_t *old = table.load(std::memory_order_relaxed);
+  if (old && words <= old->mask + 1)
+    return;
+
+  auto t = std::make_unique<table_t>();
+  t->words = std::make_unique<std::atomic<uint64_t>[]>(words);
+  for (size_t i = 0; i < words; i++)
+    t->words[i].store(0, std::memory_order_relaxed);
+
+  t->mask = words - 1;
+  t->sample_size = words * 10;
+
+  table.store(t.release(), std::memory_order_release);
+  additions.store(0, std::memory_order_relaxed);
+
+  if (old)
+    epoch::retire(old, sizeof(table_t), [](void *p, size_t) {
+      delete static_cast<table_t *>(p);
+    });
+}
+
+size_t frequency_sketch_t::capacity() const noexcept {
+  return table.load(std::memory_order_relaxed)->mask + 1;
+}
+
+size_t frequency_sketch_t::index_of(const table_t &t, uint64_t hash,
+                                    int row) noexcept {
+  uint64_t x = (hash + seeds[row]) * seeds[row];
+  x += x >> 32;
+  return x & t.mask;
+}
+
+bool frequency_sketch_t::increment_at(table_t &t, size_t i,
+                                      int nibble) noexcept {
+  const int offset = nibble << 2;
+  const uint64_t mask = uint64_t{0xf} << offset;
+
+  auto &w = t.words[i];
+  uint64_t cur = w.load(std::memory_order_relaxed);
+
+  while ((cur & mask) != mask) {
+    if (w.compare_exchange_weak(cur, cur + (uint64_t{1} << offset),
+                                std::memory_order_relaxed))
+      return true;
+  }
+
+  // saturated
+  return false;
+}
+
+void frequency_sketch_t::reset(table_t &t) noexcept {
+  for (size_t i = 0; i <= t.mask; i++) {
+    auto &w = t.words[i];
+    uint64_t cur = w.load(std::memory_order_relaxed);
+
+    while (!w.compare_exchange_weak(cur, (cur >> 1) & 0x7777777777777777ull,
+                                    std::memory_order_relaxed))
+      ;
+  }
+}
+
+void frequency_sketch_t::increment(uint64_t hash) noexcept {
+  table_t &t = *table.load(std::memory_order_acquire);
+
+  hash = util::spread_hash(hash);
+  const int start = static_cast<int>(hash & 3) << 2;
+
+  bool added = false;
+  for (int row = 0; row < 4; row++)
+    added |= increment_at(t, index_of(t, hash, row), start + row);
+
+  if (added && additions.fetch_add(1, std::memory_order_relaxed) + 1 ==
+                   t.sample_size) {
+    reset(t);
+    additions.store(t.sample_size / 2, std::memory_order_relaxed);
+  }
+}
+
+int frequency_sketch_t::frequency(uint64_t hash) const noexcept {
+  const table_t &t = *table.load(std::memory_order_acquire);
+
+  hash = util::spread_hash(hash);
+  const int start = static_cast<int>(hash & 3) << 2;
+
+  int ret = 15;
+  for (int row = 0; row < 4; row++) {
+    const int offset = (start + row) << 2;
+    const uint64_t w =
+        t.words[index_of(t, hash, row)].load(std::memory_order_relaxed);
+
+    int c = static_cast<int>((w >> offset) & 0xf);
+    if (c < ret)
+      ret = c;
+  }
+
+  return ret;
+}
+
+} // namespace ssplus_cache_me::cache
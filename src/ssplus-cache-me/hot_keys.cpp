@@ -0,0 +1,169 @@
+#include "ssplus-cache-me/hot_keys.h"
+#include "ssplus-cache-me/util.h"
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace ssplus_cache_me::hot_keys {
+
+static_assert((sample_rate & (sample_rate - 1)) == 0,
+              "sample_rate must be a power of 2");
+
+struct counter_t {
+  std::string key;
+  uint64_t count;
+  uint64_t error;
+};
+
+struct summary_t {
+  std::mutex m;
+
+  // reserved once, index keys point into the counter keys
+  std::vector<counter_t> counters;
+  std::unordered_map<std::string_view, size_t> index;
+  uint64_t since = 0;
+
+  // last complete window, already sorted
+  std::vector<counter_t> last;
+  uint64_t last_since = 0;
+  uint64_t last_duration = 0;
+
+  summary_t() {
+    counters.reserve(max_tracked);
+    index.reserve(max_tracked);
+  }
+
+  void rotate(uint64_t now) {
+    if (since == 0) {
+      since = now;
+      return;
+    }
+
+    if (now - since < window_ms)
+      return;
+
+    std::sort(counters.begin(), counters.end(),
+              [](const counter_t &a, const counter_t &b) {
+                return a.count > b.count;
+              });
+
+    index.clear();
+    last.swap(counters);
+    counters.clear();
+    counters.reserve(max_tracked);
+
+    last_since = since;
+    last_duration = now - since;
+    since = now;
+  }
+
+  void add(std::string_view key) {
+    if (auto it = index.find(key); it != index.end()) {
+      counters[it->second].count++;
+      return;
+    }
+
+    if (counters.size() < max_tracked) {
+      auto &c = counters.emplace_back(counter_t{std::string(key), 1, 0});
+      index.emplace(c.key, counters.size() - 1);
+      return;
+    }
+
+    // the key takes over the smallest counter, which may have counted it
+    // before it got evicted
+    size_t min = 0;
+    for (size_t i = 1; i < counters.size(); i++) {
+      if (counters[i].count < counters[min].count)
+        min = i;
+    }
+
+    auto &c = counters[min];
+    index.erase(c.key);
+
+    c.key.assign(key.data(), key.size());
+    c.error = c.count;
+    c.count++;
+
+    index.emplace(c.key, min);
+  }
+};
+
+static summary_t summaries[2];
+
+// xorshift32, seeded apart per thread so threads don't sample in lockstep
+static bool sampled() noexcept {
+  static thread_local uint32_t state = static_cast<uint32_t>(
+      std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1);
+
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+
+  return (state & (sample_rate - 1)) == 0;
+}
+
+void record(kind_t kind, std::string_view key) noexcept {
+  if (key.empty() || !sampled())
+    return;
+
+  auto &s = summaries[kind];
+  const uint64_t now = util::get_current_ts();
+
+  try {
+    std::lock_guard lk(s.m);
+
+    s.rotate(now);
+    s.add(key);
+  } catch (...) {
+    // out of memory, this sample is just lost
+  }
+}
+
+report_t top(kind_t kind, size_t limit) {
+  auto &s = summaries[kind];
+  const uint64_t now = util::get_current_ts();
+
+  report_t ret{};
+  std::vector<counter_t> counters;
+
+  {
+    std::lock_guard lk(s.m);
+
+    s.rotate(now);
+
+    // a window just started has seen too little to tell
+    if (s.last_duration == 0 || now - s.since >= s.last_duration) {
+      counters = s.counters;
+      ret.since = s.since;
+      ret.duration = now - s.since;
+    } else {
+      counters.assign(
+          s.last.begin(),
+          s.last.begin() + std::min(limit, s.last.size()));
+      ret.since = s.last_since;
+      ret.duration = s.last_duration;
+    }
+  }
+
+  limit = std::min(limit, counters.size());
+  std::partial_sort(counters.begin(), counters.begin() + limit,
+                    counters.end(), [](const counter_t &a, const counter_t &b) {
+                      return a.count > b.count;
+                    });
+  counters.resize(limit);
+
+  const double seconds =
+      static_cast<double>(ret.duration ? ret.duration : 1) / 1000.0;
+
+  ret.keys.reserve(limit);
+  for (auto &c : counters) {
+    const uint64_t count = c.count * sample_rate;
+    ret.keys.push_back({std::move(c.key), count, c.error * sample_rate,
+                        static_cast<double>(count) / seconds});
+  }
+
+  return ret;
+}
+
+} // namespace ssplus_cache_me::hot_keys
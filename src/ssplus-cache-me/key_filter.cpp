@@ -0,0 +1,98 @@
+#include "ssplus-cache-me/key_filter.h"
+#include "ssplus-cache-me/util.h"
+
+namespace ssplus_cache_me::cache {
+
+static constexpr int probes = 4;
+// counters per key it's sized for, before rounding up to a power of two
+static constexpr size_t counters_per_key = 12;
+
+key_filter_t::key_filter_t(size_t _max_keys)
+    : max_keys(_max_keys ? _max_keys : 1), count(0) {
+  // 16 counters per word
+  size_t n = 1;
+  while (n * 16 < max_keys * counters_per_key)
+    n <<= 1;
+
+  words = std::make_unique<std::atomic<uint64_t>[]>(n);
+  for (size_t i = 0; i < n; i++)
+    words[i].store(0, std::memory_order_relaxed);
+
+  mask = n - 1;
+}
+
+void key_filter_t::index_of(uint64_t hash, int probe, size_t &word,
+                            int &offset) const noexcept {
+  // h1 + i * h2, h2 odd so probes never repeat
+  const uint64_t h1 = hash;
+  const uint64_t h2 = (hash >> 32 | hash << 32) | 1;
+  const uint64_t x = h1 + static_cast<uint64_t>(probe) * h2;
+
+  word = (x >> 4) & mask;
+  offset = static_cast<int>(x & 0xf) << 2;
+}
+
+void key_filter_t::add(uint64_t hash) noexcept {
+  hash = util::spread_hash(hash);
+
+  for (int i = 0; i < probes; i++) {
+    size_t w;
+    int offset;
+    index_of(hash, i, w, offset);
+
+    const uint64_t cur = words[w].load(std::memory_order_relaxed);
+    if (((cur >> offset) & 0xf) != 0xf)
+      words[w].store(cur + (uint64_t{1} << offset),
+                     std::memory_order_relaxed);
+  }
+
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+}
+
+void key_filter_t::remove(uint64_t hash) noexcept {
+  hash = util::spread_hash(hash);
+
+  for (int i = 0; i < probes; i++) {
+    size_t w;
+    int offset;
+    index_of(hash, i, w, offset);
+
+    // saturated ones stay
+    const uint64_t cur = words[w].load(std::memory_order_relaxed);
+    const uint64_t c = (cur >> offset) & 0xf;
+    if (c != 0 && c != 0xf)
+      words[w].store(cur - (uint64_t{1} << offset),
+                     std::memory_order_relaxed);
+  }
+
+  if (const size_t n = count.load(std::memory_order_relaxed))
+    count.store(n - 1, std::memory_order_relaxed);
+}
+
+bool key_filter_t::may_contain(uint64_t hash) const noexcept {
+  hash = util::spread_hash(hash);
+
+  for (int i = 0; i < probes; i++) {
+    size_t w;
+    int offset;
+    index_of(hash, i, w, offset);
+
+    if (((words[w].load(std::memory_order_relaxed) >> offset) & 0xf) == 0)
+      return false;
+  }
+
+  return true;
+}
+
+size_t key_filter_t::size() const noexcept {
+  return count.load(std::memory_order_relaxed);
+}
+
+size_t key_filter_t::capacity() const noexcept { return max_keys; }
+
+size_t key_filter_t::memory_usage() const noexcept {
+  return sizeof(*this) + (mask + 1) * sizeof(uint64_t);
+}
+
+} // namespace ssplus_cache_me::cache
@@ -0,0 +1,180 @@
+#include "ssplus-cache-me/key_index.h"
+#include <algorithm>
+
+namespace ssplus_cache_me::cache {
+
+// heap bytes owned by s, short strings live in the object itself
+static size_t heap_of(const std::string &s) noexcept {
+  static const size_t sso_capacity = std::string().capacity();
+  return s.capacity() > sso_capacity ? s.capacity() + 1 : 0;
+}
+
+static bool key_less(const std::string &a, std::string_view b) noexcept {
+  return std::string_view(a) < b;
+}
+
+size_t key_index_t::leaf_of(std::string_view key) const noexcept {
+  auto it = std::upper_bound(leaves.begin(), leaves.end(), key,
+                             [](std::string_view k, const auto &leaf) {
+                               return k < std::string_view(leaf->keys.front());
+                             });
+
+  return it == leaves.begin() ? 0 : (it - leaves.begin()) - 1;
+}
+
+std::unique_ptr<key_index_t::leaf_t> key_index_t::new_leaf() const {
+  auto leaf = std::make_unique<leaf_t>();
+  // never grows past this, memory_usage() counts on it
+  leaf->keys.reserve(max_leaf_keys);
+  return leaf;
+}
+
+bool key_index_t::insert(std::string_view key) {
+  if (leaves.empty()) {
+    auto leaf = new_leaf();
+    leaf->keys.emplace_back(key);
+    key_heap_bytes += heap_of(leaf->keys.back());
+    count++;
+
+    leaves.push_back(std::move(leaf));
+    return true;
+  }
+
+  size_t li = leaf_of(key);
+  auto *keys = &leaves[li]->keys;
+  auto pos = std::lower_bound(keys->begin(), keys->end(), key, key_less);
+
+  if (pos != keys->end() && std::string_view(*pos) == key)
+    return false;
+
+  if (keys->size() == max_leaf_keys) {
+    auto leaf = new_leaf();
+
+    if (li + 1 == leaves.size() && pos == keys->end()) {
+      // appending in order, leave the full leaf full
+      keys = &leaf->keys;
+    } else {
+      const size_t half = max_leaf_keys / 2;
+
+      std::move(keys->begin() + half, keys->end(),
+                std::back_inserter(leaf->keys));
+      keys->resize(half);
+
+      if (key_less(leaf->keys.front(), key))
+        keys = &leaf->keys;
+    }
+
+    leaves.insert(leaves.begin() + li + 1, std::move(leaf));
+    pos = std::lower_bound(keys->begin(), keys->end(), key, key_less);
+  }
+
+  pos = keys->emplace(pos, key);
+  key_heap_bytes += heap_of(*pos);
+  count++;
+
+  return true;
+}
+
+void key_index_t::merge(size_t li) {
+  auto &keys = leaves[li]->keys;
+
+  if (keys.empty()) {
+    leaves.erase(leaves.begin() + li);
+    return;
+  }
+
+  // the next leaf into this one, or this one into the previous leaf
+  for (size_t left : {li, li - 1}) {
+    if (left >= leaves.size() - 1)
+      continue;
+
+    auto &l = leaves[left]->keys;
+    auto &r = leaves[left + 1]->keys;
+    if (l.size() + r.size() > max_leaf_keys / 2)
+      continue;
+
+    std::move(r.begin(), r.end(), std::back_inserter(l));
+    leaves.erase(leaves.begin() + left + 1);
+    return;
+  }
+}
+
+bool key_index_t::erase(std::string_view key) {
+  if (leaves.empty())
+    return false;
+
+  const size_t li = leaf_of(key);
+  auto &keys = leaves[li]->keys;
+  auto pos = std::lower_bound(keys.begin(), keys.end(), key, key_less);
+
+  if (pos == keys.end() || std::string_view(*pos) != key)
+    return false;
+
+  key_heap_bytes -= heap_of(*pos);
+  keys.erase(pos);
+  count--;
+
+  merge(li);
+
+  return true;
+}
+
+bool key_index_t::contains(std::string_view key) const noexcept {
+  if (leaves.empty())
+    return false;
+
+  const auto &keys = leaves[leaf_of(key)]->keys;
+  return std::binary_search(keys.begin(), keys.end(), key,
+                            [](const auto &a, const auto &b) {
+                              return std::string_view(a) <
+                                     std::string_view(b);
+                            });
+}
+
+std::vector<std::string> key_index_t::range(std::string_view prefix,
+                                            std::string_view after,
+                                            size_t limit) const {
+  std::vector<std::string> ret;
+  if (leaves.empty() || limit == 0)
+    return ret;
+
+  const bool skip_after = after >= prefix;
+  const std::string_view from = skip_after ? after : prefix;
+
+  size_t li = leaf_of(from);
+  const auto &first = leaves[li]->keys;
+  auto pos = skip_after
+                 ? std::upper_bound(first.begin(), first.end(), from,
+                                    [](std::string_view k, const auto &s) {
+                                      return k < std::string_view(s);
+                                    })
+                 : std::lower_bound(first.begin(), first.end(), from,
+                                    key_less);
+  size_t i = pos - first.begin();
+
+  for (; li < leaves.size(); li++, i = 0) {
+    const auto &keys = leaves[li]->keys;
+
+    for (; i < keys.size(); i++) {
+      if (keys[i].compare(0, prefix.size(), prefix) != 0)
+        return ret;
+
+      ret.push_back(keys[i]);
+      if (ret.size() == limit)
+        return ret;
+    }
+  }
+
+  return ret;
+}
+
+size_t key_index_t::size() const noexcept { return count; }
+
+size_t key_index_t::memory_usage() const noexcept {
+  return sizeof(*this) + leaves.capacity() * sizeof(leaves[0]) +
+         leaves.size() *
+             (sizeof(leaf_t) + max_leaf_keys * sizeof(std::string)) +
+         key_heap_bytes;
+}
+
+} // namespace ssplus_cache_me::cache
@@ -0,0 +1,125 @@
+#include "ssplus-cache-me/near_cache.h"
+#include "ssplus-cache-me/util.h"
+#include <atomic>
+
+namespace ssplus_cache_me::cache {
+
+// misses of a key before it's admitted
+static constexpr int admit_frequency = 2;
+
+// keys the sketch tracks per slot, most keys missing here are cold ones
+static constexpr size_t sketch_keys_per_slot = 8;
+
+near_cache_t::near_cache_t(size_t capacity)
+    : max_slots(capacity ? capacity : 1) {
+  // slots never move, index keys point into them
+  slots.reserve(max_slots);
+  index.reserve(max_slots);
+
+  sketch.ensure_capacity(max_slots * sketch_keys_per_slot);
+}
+
+void near_cache_t::erase_at(size_t i) {
+  auto &s = slots[i];
+
+  index.erase(s.key);
+
+  s.key.clear();
+  s.data.clear();
+  s.referenced = false;
+}
+
+const data_t *near_cache_t::find(std::string_view key) {
+  auto it = index.find(key);
+  if (it == index.end())
+    return nullptr;
+
+  auto &s = slots[it->second];
+
+  const uint64_t eat = s.data.get_expires_at();
+  if (eat != 0 && eat <= util::get_current_ts()) {
+    erase_at(it->second);
+    return nullptr;
+  }
+
+  s.referenced = true;
+  return &s.data;
+}
+
+void near_cache_t::admit(std::string_view key, const data_t &data) {
+  const size_t hash = key_hash(key);
+
+  sketch.increment(hash);
+  if (sketch.frequency(hash) < admit_frequency)
+    return;
+
+  // a private copy, the shared one lives in a block other threads read
+  data_t own = data;
+  own.value = value_t(data.value.data(), data.value.size());
+
+  if (auto it = index.find(key); it != index.end()) {
+    slots[it->second].data = std::move(own);
+    return;
+  }
+
+  size_t i;
+
+  if (slots.size() < max_slots) {
+    i = slots.size();
+    slots.emplace_back();
+  } else {
+    // CLOCK, free slots have no key and are taken right away
+    while (true) {
+      auto &s = slots[clock_hand];
+      if (s.key.empty() || !s.referenced)
+        break;
+
+      s.referenced = false;
+      clock_hand = (clock_hand + 1) % slots.size();
+    }
+
+    i = clock_hand;
+    clock_hand = (clock_hand + 1) % slots.size();
+
+    if (!slots[i].key.empty())
+      erase_at(i);
+  }
+
+  auto &s = slots[i];
+  s.key.assign(key.data(), key.size());
+  s.data = std::move(own);
+  s.referenced = false;
+
+  index.emplace(s.key, i);
+}
+
+void near_cache_t::erase(std::string_view key) {
+  auto it = index.find(key);
+  if (it != index.end())
+    erase_at(it->second);
+}
+
+void near_cache_t::erase_prefix(std::string_view prefix) {
+  for (size_t i = 0; i < slots.size(); i++) {
+    const auto &k = slots[i].key;
+    if (!k.empty() && k.compare(0, prefix.size(), prefix) == 0)
+      erase_at(i);
+  }
+}
+
+size_t near_cache_t::size() const noexcept { return index.size(); }
+
+size_t near_cache_t::capacity() const noexcept { return max_slots; }
+
+static std::atomic<near_invalidator_t> near_invalidator{nullptr};
+
+void set_near_invalidator(near_invalidator_t fn) noexcept {
+  near_invalidator.store(fn, std::memory_order_release);
+}
+
+void invalidate_near(std::string_view key, bool prefix) {
+  if (auto fn = near_invalidator.load(std::memory_order_acquire))
+    fn(key, prefix);
+}
+
+} // namespace ssplus_cache_me::cache
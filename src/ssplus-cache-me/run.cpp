@@ -1,7 +1,9 @@
 #include "ssplus-cache-me/run.h"
 #include "nlohmann/json.hpp"
+#include "ssplus-cache-me/cache.h"
 #include "ssplus-cache-me/config.h"
 #include "ssplus-cache-me/db.h"
+#include "ssplus-cache-me/epoch.h"
 #include "ssplus-cache-me/info.h"
 #include "ssplus-cache-me/query_runner.h"
 #include "ssplus-cache-me/server_manager.h"
@@ -163,10 +165,11 @@ static void write_query_routine() {
       // log::io() << "cur(" << cur << ") top_sch(" << top_sch << ")\n";
 
       if (top_sch > cur) {
+        // one more tick so the coarse clock has caught up on wake
         main_state.mcv.wait_until(
             lk,
             std::chrono::system_clock::time_point{
-                std::chrono::milliseconds(top_sch)},
+                std::chrono::milliseconds(top_sch + util::clock_tick_ms)},
             [&top_sch] {
               return top_sch <= util::get_current_ts() ||
                      top_sch != main_state.write_queries.top().ts ||
@@ -197,9 +200,60 @@ static void write_query_routine() {
 static void main_loop() {
   while (main_state.running) {
     write_query_routine();
+
+    // cache entries evicted once persisted were retired by this thread
+    epoch::quiescent();
   }
 }
 
+// queue adding column with definition to the cache table when it's missing
+static void enqueue_add_column(const std::string &column,
+                               const std::string &definition) {
+  query_schedule_t q("add_" + column);
+
+  q.query = "SELECT COUNT(*) FROM pragma_table_info('cache') "
+            "WHERE \"name\" = '" +
+            column + "';";
+
+  q.run = [column, definition](sqlite3_stmt **statement,
+                               const query_schedule_t &q,
+                               sqlite3 *conn) -> int {
+    int status = sqlite3_step(*statement);
+    const bool exists =
+        status == SQLITE_ROW && sqlite3_column_int(*statement, 0) > 0;
+
+    // this statement only run once on boot so delete it immediately
+    db::finalize_statement(q.query, statement);
+
+    if (status != SQLITE_ROW) {
+      log::io() << DEBUG_WHERE << "Failed checking for " << column
+                << " column: " << sqlite3_errmsg(conn) << "\n";
+      return status;
+    }
+
+    if (exists)
+      return SQLITE_DONE;
+
+    const std::string alter = "ALTER TABLE \"cache\" ADD COLUMN \"" +
+                              column + "\" " + definition + ";";
+
+    char *err = nullptr;
+    status = sqlite3_exec(conn, alter.c_str(), nullptr, nullptr, &err);
+
+    if (status != SQLITE_OK) {
+      log::io() << DEBUG_WHERE << "Failed adding " << column
+                << " column: " << (err ? err : "") << "\n";
+      sqlite3_free(err);
+      return status;
+    }
+
+    log::io() << "Added " << column << " column to the cache table\n";
+    return SQLITE_DONE;
+  };
+
+  enqueue_write_query(q);
+}
+
 static int init_db(const char *path) {
   db::setup();
 
@@ -240,7 +294,10 @@ static int init_db(const char *path) {
 
     init_q.query = "CREATE TABLE IF NOT EXISTS \"cache\" (\"key\" VARCHAR "
                    "UNIQUE PRIMARY KEY NOT NULL, \"value\" VARCHAR NOT NULL, "
-                   "\"expires_at\" UNSIGNED BIG INT DEFAULT 0);";
+                   "\"expires_at\" UNSIGNED BIG INT DEFAULT 0, "
+                   "\"codec\" INTEGER NOT NULL DEFAULT 0, "
+                   "\"version\" INTEGER NOT NULL DEFAULT 0, "
+                   "\"delta\" INTEGER NOT NULL DEFAULT 0);";
 
     init_q.run = [](sqlite3_stmt **statement, const query_schedule_t &q,
                     sqlite3 *conn) -> int {
@@ -253,6 +310,49 @@ static int init_db(const char *path) {
 
     enqueue_write_query(init_q);
 
+    // tags of keys, see db::delete_tag()
+    query_schedule_t tags_q("init_tags");
+
+    tags_q.query = "CREATE TABLE IF NOT EXISTS \"cache_tags\" (\"tag\" "
+                   "VARCHAR NOT NULL, \"key\" VARCHAR NOT NULL, "
+                   "PRIMARY KEY (\"tag\", \"key\"));";
+
+    tags_q.run = [](sqlite3_stmt **statement, const query_schedule_t &q,
+                    sqlite3 *conn) -> int {
+      int status = query_runner::run_until_done(*statement, q, conn);
+
+      // this statement only run once on boot so delete it immediately
+      db::finalize_statement(q.query, statement);
+
+      if (status != SQLITE_DONE)
+        return status;
+
+      // the tags of a key are replaced and deleted by key
+      char *err = nullptr;
+      status = sqlite3_exec(conn,
+                            "CREATE INDEX IF NOT EXISTS \"cache_tags_key\" "
+                            "ON \"cache_tags\" (\"key\");",
+                            nullptr, nullptr, &err);
+
+      if (status != SQLITE_OK) {
+        log::io() << DEBUG_WHERE << "Failed creating cache_tags index: "
+                  << (err ? err : "") << "\n";
+        sqlite3_free(err);
+        return status;
+      }
+
+      return SQLITE_DONE;
+    };
+
+    enqueue_write_query(tags_q);
+
+    // tables created before values got compressed lack the codec column,
+    // before entries got versioned the version one, before early refresh
+    // the delta one
+    enqueue_add_column("codec", "INTEGER NOT NULL DEFAULT 0");
+    enqueue_add_column("version", "INTEGER NOT NULL DEFAULT 0");
+    enqueue_add_column("delta", "INTEGER NOT NULL DEFAULT 0");
+
     // delete expired caches
     query_schedule_t delex_q("delete_expires");
 
@@ -282,6 +382,29 @@ static int init_db(const char *path) {
     };
 
     enqueue_write_query(delex_q);
+
+    // tags of the rows just deleted, and of any deleted before tags were
+    // cleaned up with them
+    query_schedule_t deltags_q("delete_orphan_tags");
+
+    deltags_q.query = "DELETE FROM \"cache_tags\" WHERE \"key\" NOT IN "
+                      "(SELECT \"key\" FROM \"cache\") ;";
+
+    deltags_q.run = [](sqlite3_stmt **statement, const query_schedule_t &q,
+                       sqlite3 *conn) -> int {
+      int status = query_runner::run_until_done(*statement, q, conn);
+
+      // this statement only run once on boot so delete it immediately
+      db::finalize_statement(q.query, statement);
+      return status;
+    };
+
+    enqueue_write_query(deltags_q);
+
+    // after the boot cleanup so it only counts what's left
+    db::load_key_filter();
+    db::load_tags();
+    db::load_max_version();
   }
 
   return status;
@@ -345,11 +468,25 @@ int run(int argc, char *argv[]) {
     fprintf(stderr, "\n");
   }
 
+  // every ttl check reads this instead of the system clock
+  util::start_clock();
+
+  if (main_state.cache_conf.shard_count == 0)
+    main_state.cache_conf.shard_count =
+        static_cast<size_t>(main_state.concurrency) * 4;
+
+  cache::init(main_state.cache_conf);
+
   if (init_db(sconf.db_path.c_str()) != 0) {
     log::io() << "Failed initializing database\n";
+    cache::shutdown();
+    util::stop_clock();
     return 1;
   }
 
+  // servers take traffic meanwhile, GET /ready tells when it's done
+  db::warm_up(sconf.db_path, main_state.warm_up_threads);
+
   main_state.running = true;
 
   server_manager_t<false> smanager;
@@ -370,6 +507,9 @@ int run(int argc, char *argv[]) {
   smanager.shutdown();
   ssl_smanager.shutdown();
 
+  cache::shutdown();
+  util::stop_clock();
+
   return 0;
 }
 
@@ -379,7 +519,7 @@ static bool remove_query_unlocked(const query_schedule_t &q) noexcept {
   auto i = std::find(main_state.write_queries.begin(),
                      main_state.write_queries.end(), q);
   if (i != main_state.write_queries.end()) {
-    main_state.write_queries.erase(i);
+    main_state.write_queries.remove(i);
     return true;
   }
 
@@ -397,10 +537,17 @@ void enqueue_write_query(const query_schedule_t &q) {
   // remove all schedule with the same id
   remove_query_unlocked(q);
 
-  main_state.write_queries.push_back(q);
+  main_state.write_queries.push(q);
   main_state.mcv.notify_one();
 }
 
+void get_write_queue_stats(size_t &count, size_t &bytes) {
+  std::shared_lock lk(main_state.mm);
+
+  count = main_state.write_queries.size();
+  bytes = main_state.write_queries.get_bytes();
+}
+
 const char *get_exe_name() noexcept { return exe_name; }
 
 } // namespace ssplus_cache_me
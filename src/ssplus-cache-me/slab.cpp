@@ -0,0 +1,324 @@
+#include "ssplus-cache-me/slab.h"
+#include "ssplus-cache-me/debug.h"
+#include "ssplus-cache-me/log.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+
+DECLARE_DEBUG_INFO_DEFAULT();
+
+namespace ssplus_cache_me::slab {
+
+static constexpr size_t arena_size = size_t{2} << 20;
+static constexpr size_t span_size = size_t{64} << 10;
+
+static constexpr size_t class_count = 36;
+static constexpr size_t max_magazine = 64;
+
+// 16 byte steps up to 128, then 4 classes per power of two up to max_size.
+// Every class is a multiple of 16 so objects stay 16 byte aligned
+struct size_classes_t {
+  size_t size[class_count];
+  size_t magazine[class_count];
+  uint8_t index[max_size / 16 + 1];
+
+  constexpr size_classes_t() : size{}, magazine{}, index{} {
+    size_t c = 0;
+    for (size_t s = 16; s <= 128; s += 16)
+      size[c++] = s;
+
+    for (size_t p = 128; p < max_size; p *= 2)
+      for (size_t q = 1; q <= 4; q++)
+        size[c++] = p + p / 4 * q;
+
+    for (c = 0; c < class_count; c++) {
+      // keep roughly 32KB per class per thread
+      size_t m = 32768 / size[c];
+      magazine[c] = m < 4 ? 4 : m > max_magazine ? max_magazine : m;
+    }
+
+    c = 0;
+    for (size_t i = 0; i <= max_size / 16; i++) {
+      while (size[c] < i * 16)
+        c++;
+      index[i] = static_cast<uint8_t>(c);
+    }
+  }
+};
+
+static constexpr size_classes_t size_classes;
+
+static_assert(size_classes.size[class_count - 1] == max_size);
+
+static size_t class_of(size_t n) noexcept {
+  return size_classes.index[(n + 15) >> 4];
+}
+
+struct alignas(64) class_t {
+  std::mutex m;
+
+  // freed objects, linked through their first word
+  void *free_list = nullptr;
+
+  // uncarved rest of the last span
+  char *bump = nullptr;
+  char *bump_end = nullptr;
+
+  size_t spans = 0;
+  // objects handed out to magazines or callers
+  size_t used = 0;
+};
+
+static class_t classes[class_count];
+
+static std::atomic<bool> use_huge_pages = false;
+
+static std::mutex arena_m;
+static char *arena_cur = nullptr;
+static char *arena_end = nullptr;
+static std::atomic<size_t> reserved_bytes = 0;
+static std::atomic<size_t> large_bytes = 0;
+
+static char *map_arena() {
+  const int prot = PROT_READ | PROT_WRITE;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (!use_huge_pages.load(std::memory_order_relaxed)) {
+    void *p = mmap(nullptr, arena_size, prot, flags, -1, 0);
+    return p == MAP_FAILED ? nullptr : static_cast<char *>(p);
+  }
+
+#ifdef MAP_HUGETLB
+  void *p = mmap(nullptr, arena_size, prot, flags | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    return static_cast<char *>(p);
+#endif // MAP_HUGETLB
+
+  // no reserved huge pages, ask for transparent ones instead. They need
+  // the range to be 2MB aligned so map twice the size and trim
+  p = mmap(nullptr, arena_size * 2, prot, flags, -1, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  const uintptr_t aligned = (start + arena_size - 1) & ~(arena_size - 1);
+
+  if (aligned > start)
+    munmap(p, aligned - start);
+  if (aligned + arena_size < start + arena_size * 2)
+    munmap(reinterpret_cast<void *>(aligned + arena_size),
+           start + arena_size - aligned);
+
+#ifdef MADV_HUGEPAGE
+  madvise(reinterpret_cast<void *>(aligned), arena_size, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+
+  return reinterpret_cast<char *>(aligned);
+}
+
+static char *new_span() {
+  std::lock_guard lk(arena_m);
+
+  if (arena_cur == arena_end) {
+    char *arena = map_arena();
+    if (!arena) {
+      log::io() << DEBUG_WHERE << "Failed mapping slab arena\n";
+      return nullptr;
+    }
+
+    arena_cur = arena;
+    arena_end = arena + arena_size;
+    reserved_bytes.fetch_add(arena_size, std::memory_order_relaxed);
+  }
+
+  char *ret = arena_cur;
+  arena_cur += span_size;
+  return ret;
+}
+
+// hand up to n objects of class c to out, returns how many
+static size_t central_take(size_t c, void **out, size_t n) {
+  auto &cl = classes[c];
+  const size_t size = size_classes.size[c];
+
+  std::lock_guard lk(cl.m);
+
+  size_t got = 0;
+  while (got < n && cl.free_list) {
+    void *p = cl.free_list;
+    cl.free_list = *static_cast<void **>(p);
+    out[got++] = p;
+  }
+
+  while (got < n) {
+    if (cl.bump_end - cl.bump < static_cast<ptrdiff_t>(size)) {
+      char *span = new_span();
+      if (!span)
+        break;
+
+      cl.bump = span;
+      cl.bump_end = span + span_size;
+      cl.spans++;
+    }
+
+    out[got++] = cl.bump;
+    cl.bump += size;
+  }
+
+  cl.used += got;
+  return got;
+}
+
+static void central_give(size_t c, void **in, size_t n) noexcept {
+  auto &cl = classes[c];
+
+  std::lock_guard lk(cl.m);
+
+  for (size_t i = 0; i < n; i++) {
+    *static_cast<void **>(in[i]) = cl.free_list;
+    cl.free_list = in[i];
+  }
+
+  cl.used -= n;
+}
+
+struct magazine_t {
+  void *items[max_magazine];
+  size_t count;
+};
+
+// trivially destructible so deallocations during static destruction can
+// still check it after the thread's flusher ran
+static thread_local magazine_t magazines[class_count];
+static thread_local bool magazines_closed = false;
+
+// gives cached objects back to their class when the thread exits
+struct flusher_t {
+  bool armed = false;
+
+  ~flusher_t() {
+    for (size_t c = 0; c < class_count; c++) {
+      auto &mag = magazines[c];
+      if (mag.count)
+        central_give(c, mag.items, mag.count);
+      mag.count = 0;
+    }
+
+    magazines_closed = true;
+  }
+};
+
+static thread_local flusher_t flusher;
+
+static void *allocate_slow(size_t c) {
+  void *ret = nullptr;
+
+  if (magazines_closed) {
+    central_take(c, &ret, 1);
+    return ret;
+  }
+
+  flusher.armed = true;
+
+  auto &mag = magazines[c];
+  mag.count = central_take(c, mag.items, size_classes.magazine[c] / 2 + 1);
+
+  if (mag.count)
+    ret = mag.items[--mag.count];
+
+  return ret;
+}
+
+void set_huge_pages(bool enabled) noexcept {
+  use_huge_pages.store(enabled, std::memory_order_relaxed);
+}
+
+bool huge_pages() noexcept {
+  return use_huge_pages.load(std::memory_order_relaxed);
+}
+
+void *allocate(size_t n) {
+  if (n > max_size) {
+    void *p = std::malloc(n);
+    if (!p)
+      throw std::bad_alloc();
+
+    large_bytes.fetch_add(usable_size(n), std::memory_order_relaxed);
+    return p;
+  }
+
+  const size_t c = class_of(n);
+  auto &mag = magazines[c];
+
+  void *p = mag.count ? mag.items[--mag.count] : allocate_slow(c);
+  if (!p)
+    throw std::bad_alloc();
+
+  return p;
+}
+
+void deallocate(void *p, size_t n) noexcept {
+  if (!p)
+    return;
+
+  if (n > max_size) {
+    large_bytes.fetch_sub(usable_size(n), std::memory_order_relaxed);
+    return std::free(p);
+  }
+
+  const size_t c = class_of(n);
+
+  if (magazines_closed)
+    return central_give(c, &p, 1);
+
+  auto &mag = magazines[c];
+  const size_t cap = size_classes.magazine[c];
+
+  if (mag.count == 0)
+    flusher.armed = true;
+  else if (mag.count == cap) {
+    // keep half so alternating alloc/free doesn't bounce on the lock
+    central_give(c, mag.items + cap / 2, cap - cap / 2);
+    mag.count = cap / 2;
+  }
+
+  mag.items[mag.count++] = p;
+}
+
+size_t usable_size(size_t n) noexcept {
+  if (n == 0)
+    return 0;
+
+  if (n > max_size)
+    // glibc adds an 8 byte header and rounds chunks up to 16
+    return (n + 8 + 15) & ~size_t{15};
+
+  return size_classes.size[class_of(n)];
+}
+
+std::vector<class_stats_t> get_class_stats() {
+  std::vector<class_stats_t> ret;
+  ret.reserve(class_count);
+
+  for (size_t c = 0; c < class_count; c++) {
+    auto &cl = classes[c];
+
+    std::lock_guard lk(cl.m);
+    ret.push_back({size_classes.size[c], cl.spans * span_size, cl.used});
+  }
+
+  return ret;
+}
+
+size_t get_reserved_bytes() noexcept {
+  return reserved_bytes.load(std::memory_order_relaxed);
+}
+
+size_t get_large_bytes() noexcept {
+  return large_bytes.load(std::memory_order_relaxed);
+}
+
+} // namespace ssplus_cache_me::slab
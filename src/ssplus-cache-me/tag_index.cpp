@@ -0,0 +1,72 @@
+#include "ssplus-cache-me/tag_index.h"
+
+namespace ssplus_cache_me::cache {
+
+// hash nodes of both maps and the vector slot, on top of the strings
+static constexpr size_t pair_overhead = 96;
+
+static size_t pair_bytes(const std::string &key,
+                         const std::string &tag) noexcept {
+  // both strings are held twice, once per direction
+  return pair_overhead + 2 * (key.size() + tag.size());
+}
+
+void tag_index_t::set(const std::string &key,
+                      const std::vector<std::string> &tags) {
+  erase(key);
+
+  for (const auto &tag : tags)
+    add(key, tag);
+}
+
+void tag_index_t::add(const std::string &key, const std::string &tag) {
+  if (!keys_of[tag].insert(key).second)
+    return;
+
+  tags_of[key].push_back(tag);
+  pairs++;
+  bytes += pair_bytes(key, tag);
+}
+
+void tag_index_t::erase(const std::string &key) {
+  auto it = tags_of.find(key);
+  if (it == tags_of.end())
+    return;
+
+  for (const auto &tag : it->second) {
+    auto k = keys_of.find(tag);
+    k->second.erase(key);
+
+    if (k->second.empty())
+      keys_of.erase(k);
+
+    pairs--;
+    bytes -= pair_bytes(key, tag);
+  }
+
+  tags_of.erase(it);
+}
+
+bool tag_index_t::has(const std::string &key) const {
+  return tags_of.find(key) != tags_of.end();
+}
+
+std::vector<std::string> tag_index_t::keys(const std::string &tag) const {
+  auto it = keys_of.find(tag);
+  if (it == keys_of.end())
+    return {};
+
+  return std::vector<std::string>(it->second.begin(), it->second.end());
+}
+
+size_t tag_index_t::tag_count() const noexcept { return keys_of.size(); }
+
+size_t tag_index_t::size() const noexcept { return pairs; }
+
+size_t tag_index_t::memory_usage() const noexcept {
+  return sizeof(*this) +
+         (keys_of.bucket_count() + tags_of.bucket_count()) * sizeof(void *) +
+         bytes;
+}
+
+} // namespace ssplus_cache_me::cache
@@ -0,0 +1,98 @@
+#include "ssplus-cache-me/timer_wheel.h"
+
+namespace ssplus_cache_me::cache {
+
+static constexpr uint64_t level_mask = timer_wheel_t::level_size - 1;
+static constexpr uint64_t max_distance =
+    uint64_t{1} << (timer_wheel_t::level_bits * timer_wheel_t::levels);
+
+// round up, a timer must never fire before its expires_at
+static uint64_t tick_of(uint64_t ms) noexcept {
+  return (ms + timer_wheel_t::tick_ms - 1) / timer_wheel_t::tick_ms;
+}
+
+timer_wheel_t::timer_wheel_t(uint64_t now_ms)
+    : current(now_ms / tick_ms), count(0) {}
+
+void timer_wheel_t::place(timer_t &&t) {
+  uint64_t tick = tick_of(t.expires_at);
+  if (tick < current)
+    tick = current;
+
+  uint64_t distance = tick - current;
+  if (distance >= max_distance)
+    tick = current + max_distance - 1, distance = max_distance - 1;
+
+  int level = 0;
+  while (distance >= (uint64_t{1} << (level_bits * (level + 1))))
+    level++;
+
+  slots[level][(tick >> (level_bits * level)) & level_mask].push_back(
+      std::move(t));
+}
+
+void timer_wheel_t::cascade(int level) {
+  auto &slot = slots[level][(current >> (level_bits * level)) & level_mask];
+  if (slot.empty())
+    return;
+
+  std::vector<timer_t> timers;
+  timers.swap(slot);
+
+  for (auto &t : timers)
+    place(std::move(t));
+}
+
+void timer_wheel_t::add(size_t hash, uint64_t expires_at) {
+  place({hash, expires_at});
+  count++;
+}
+
+void timer_wheel_t::advance(uint64_t now_ms, std::vector<timer_t> &due) {
+  const uint64_t now_tick = now_ms / tick_ms;
+
+  if (count == 0) {
+    // nothing to cascade, jump straight to now
+    if (now_tick >= current)
+      current = now_tick + 1;
+    return;
+  }
+
+  for (; current <= now_tick && count > 0; current++) {
+    // the level below wrapped, bring the next slot of every level above
+    // one step closer
+    for (int level = 1; level < levels; level++) {
+      if ((current >> (level_bits * (level - 1))) & level_mask)
+        break;
+
+      cascade(level);
+    }
+
+    auto &slot = slots[0][current & level_mask];
+    if (slot.empty())
+      continue;
+
+    std::vector<timer_t> timers;
+    timers.swap(slot);
+
+    for (auto &t : timers) {
+      // parked beyond max_distance, not actually due yet
+      if (t.expires_at > now_ms) {
+        place(std::move(t));
+        continue;
+      }
+
+      due.push_back(std::move(t));
+      count--;
+    }
+  }
+
+  if (count == 0 && current <= now_tick)
+    current = now_tick + 1;
+}
+
+size_t timer_wheel_t::size() const noexcept { return count; }
+
+bool timer_wheel_t::empty() const noexcept { return count == 0; }
+
+} // namespace ssplus_cache_me::cache
@@ -1,15 +1,51 @@
 #include "ssplus-cache-me/util.h"
+#include <atomic>
 #include <chrono>
+#include <thread>
 
 namespace ssplus_cache_me::util {
 
-uint64_t get_current_ts() {
+static uint64_t system_ts() noexcept {
   return std::chrono::time_point_cast<std::chrono::milliseconds>(
              std::chrono::system_clock::now())
       .time_since_epoch()
       .count();
 }
 
+// last tick of clock_thread, 0 while it isn't running
+static std::atomic<uint64_t> clock_ts = 0;
+static std::atomic<bool> clock_running = false;
+static std::thread clock_thread;
+
+static void clock_routine() {
+  while (clock_running.load(std::memory_order_relaxed)) {
+    clock_ts.store(system_ts(), std::memory_order_relaxed);
+    std::this_thread::sleep_for(std::chrono::milliseconds(clock_tick_ms));
+  }
+}
+
+uint64_t get_current_ts() noexcept {
+  const uint64_t ts = clock_ts.load(std::memory_order_relaxed);
+  return ts ? ts : system_ts();
+}
+
+void start_clock() {
+  if (clock_running.exchange(true))
+    return;
+
+  // readers get a valid ts as soon as this returns
+  clock_ts.store(system_ts(), std::memory_order_relaxed);
+  clock_thread = std::thread(clock_routine);
+}
+
+void stop_clock() noexcept {
+  if (!clock_running.exchange(false))
+    return;
+
+  clock_thread.join();
+  clock_ts.store(0, std::memory_order_relaxed);
+}
+
 uint64_t ms_to_ns(uint64_t ms) noexcept { return ms * 1000'000; }
 
 static bool trim_pred(char v) { return std::isspace(v); };
@@ -25,4 +61,51 @@ std::string trim(const std::string &s) {
   return {};
 }
 
+void json_escape(std::string &out, std::string_view s) {
+  static constexpr const char hex[] = "0123456789abcdef";
+
+  out.reserve(out.size() + s.size() + 2);
+
+  size_t start = 0;
+  for (size_t i = 0; i < s.size(); i++) {
+    const auto c = static_cast<unsigned char>(s[i]);
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+
+    // flush the clean run before this char in one go
+    out.append(s.data() + start, i - start);
+    start = i + 1;
+
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default: {
+      const char u[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+      out.append(u, sizeof(u));
+    }
+    }
+  }
+
+  out.append(s.data() + start, s.size() - start);
+}
+
 } // namespace ssplus_cache_me::util